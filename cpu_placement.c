@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu_placement.h"
+
+struct logical_cpu {
+    int cpu;
+    int package;
+    int core;
+    int sibling;  /* Its index among the CPUs of its core */
+};
+
+/* A number from the CPU's topology in sysfs, or `fallback` if there is none
+ * (as in some containers) */
+static int topology_read(int cpu, const char *name, int fallback)
+{
+    char path[96];
+    int value;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+            cpu, name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return fallback;
+    if (fscanf(f, "%d", &value) != 1)
+        value = fallback;
+    fclose(f);
+    return value;
+}
+
+static int cpu_by_core(const void *a, const void *b)
+{
+    const struct logical_cpu *x = a, *y = b;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/* Each core's first CPU before any core's second, and so on */
+static int cpu_by_sibling(const void *a, const void *b)
+{
+    const struct logical_cpu *x = a, *y = b;
+    if (x->sibling != y->sibling)
+        return x->sibling - y->sibling;
+    return cpu_by_core(a, b);
+}
+
+/* The CPUs the calling thread may use, sorted by core. Returns how many. */
+static int cpus_allowed(struct logical_cpu **out)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        CPU_ZERO(&set);
+        for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN); i++)
+            CPU_SET(i, &set);
+    }
+    int n = CPU_COUNT(&set);
+    struct logical_cpu *cpus = malloc(sizeof(struct logical_cpu) * n);
+    for (int i = 0, k = 0; i < CPU_SETSIZE && k < n; i++) {
+        if (!CPU_ISSET(i, &set))
+            continue;
+        cpus[k].cpu = i;
+        cpus[k].package = topology_read(i, "physical_package_id", 0);
+        cpus[k].core = topology_read(i, "core_id", i);
+        k++;
+    }
+    qsort(cpus, n, sizeof(struct logical_cpu), cpu_by_core);
+    for (int i = 0; i < n; i++)
+        cpus[i].sibling = i > 0 && cpus[i].package == cpus[i-1].package
+            && cpus[i].core == cpus[i-1].core ? cpus[i-1].sibling + 1 : 0;
+    *out = cpus;
+    return n;
+}
+
+void placement_init(struct worker_placement *p, int n_workers, bool pin,
+        enum smt_policy smt)
+{
+    struct logical_cpu *cpus;
+    int n = cpus_allowed(&cpus);
+    int n_kept = 0;
+    p->pin = pin;
+    p->smt = smt;
+    p->n_cores = 0;
+    for (int i = 0; i < n; i++)
+        p->n_cores += cpus[i].sibling == 0;
+    /* The last core's CPUs are the last in the list, down to sibling 0 */
+    if (pin && p->n_cores > 1)
+        do
+            n_kept++;
+        while (cpus[n - n_kept].sibling > 0);
+    p->n_main_cpus = n_kept > 0 ? n_kept : n;
+    p->main_cpus = malloc(sizeof(int) * p->n_main_cpus);
+    for (int i = 0; i < p->n_main_cpus; i++)
+        p->main_cpus[i] = cpus[n - p->n_main_cpus + i].cpu;
+
+    int n_usable = n - n_kept;
+    int n_slots = n_usable;
+    qsort(cpus, n_usable, sizeof(struct logical_cpu), cpu_by_sibling);
+    if (smt == SMT_CORES)
+        for (n_slots = 0; n_slots < n_usable && cpus[n_slots].sibling == 0;
+                n_slots++);
+    p->n_workers = n_workers > 0 ? n_workers : n_slots;
+    p->worker_cpus = NULL;
+    if (pin) {
+        p->worker_cpus = malloc(sizeof(int) * p->n_workers);
+        for (int i = 0; i < p->n_workers; i++)
+            p->worker_cpus[i] = cpus[i % n_slots].cpu;
+    }
+    free(cpus);
+}
+
+void placement_clear(struct worker_placement *p)
+{
+    free(p->worker_cpus);
+    free(p->main_cpus);
+}
+
+void placement_worker_attr(const struct worker_placement *p, int worker,
+        pthread_attr_t *attr)
+{
+    cpu_set_t set;
+    if (!p->pin)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(p->worker_cpus[worker], &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/* Unpinned, this undoes an earlier pinned plan's binding */
+void placement_bind_main(const struct worker_placement *p)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < p->n_main_cpus; i++)
+        CPU_SET(p->main_cpus[i], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void placement_describe(const struct worker_placement *p, char *buf,
+        int size)
+{
+    int len = snprintf(buf, size, "%d worker%s %s, one per %s", p->n_workers,
+            p->n_workers == 1 ? "" : "s",
+            p->pin ? "pinned" : "unpinned",
+            p->smt == SMT_CORES ? "core" : "logical CPU");
+    if (!p->pin || p->n_cores < 2)
+        return;
+    len += snprintf(buf + len, size > len ? size - len : 0,
+            ", main thread on CPU%s", p->n_main_cpus > 1 ? "s" : "");
+    for (int i = 0; i < p->n_main_cpus; i++)
+        len += snprintf(buf + len, size > len ? size - len : 0, "%s%d",
+                i > 0 ? "," : " ", p->main_cpus[i]);
+}
+
+const char *smt_policy_name(enum smt_policy smt)
+{
+    return smt == SMT_CORES ? "cores" : "threads";
+}
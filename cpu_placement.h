@@ -0,0 +1,50 @@
+#ifndef __CPU_PLACEMENT_H
+#define __CPU_PLACEMENT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Which logical CPUs get workers */
+enum smt_policy {
+    SMT_THREADS,  /* One per logical CPU, hyperthread siblings included */
+    SMT_CORES,    /* One per physical core, leaving its siblings idle */
+};
+
+/* Where the workers and the main thread run, worked out once at startup
+ * from the CPUs the process may use and their cores and sockets as Linux
+ * reports them. Unpinned threads go wherever the scheduler puts them.
+ *
+ * Pinned workers are each bound to one CPU, spread over the cores (and
+ * sockets) before any core gets a second one. Given more than one core,
+ * the last is kept for the main thread, which runs the event loop, so that
+ * it is never queued behind a worker. */
+struct worker_placement {
+    int n_workers;
+    bool pin;
+    enum smt_policy smt;
+    int *worker_cpus;  /* If pinned, worker i's CPU */
+    /* The CPUs the main thread is bound to: the kept core if pinned,
+     * otherwise all the process may use */
+    int *main_cpus;
+    int n_main_cpus;
+    int n_cores;  /* Physical cores the process may use */
+};
+
+/* Plan `n_workers` workers, or one per CPU the policy allows (leaving out
+ * the main thread's core if pinned) if n_workers is 0. Asking for more
+ * workers than that puts more than one on some CPUs. Only the CPUs the
+ * calling thread may use are planned for. */
+void placement_init(struct worker_placement *p, int n_workers, bool pin,
+        enum smt_policy smt);
+void placement_clear(struct worker_placement *p);
+/* Set the affinity of a worker thread about to be created */
+void placement_worker_attr(const struct worker_placement *p, int worker,
+        pthread_attr_t *attr);
+/* Bind the calling thread where the plan puts the main thread */
+void placement_bind_main(const struct worker_placement *p);
+/* e.g. "8 workers pinned, one per core" */
+void placement_describe(const struct worker_placement *p, char *buf,
+        int size);
+const char *smt_policy_name(enum smt_policy smt);
+
+#endif
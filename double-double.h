@@ -0,0 +1,107 @@
+#ifndef __DOUBLE_DOUBLE_H
+#define __DOUBLE_DOUBLE_H
+
+#include <mpfr.h>
+
+/* Double-double numbers: an unevaluated sum hi + lo of two doubles with
+ * |lo| <= ulp(hi)/2, giving ~106 bits of mantissa. That covers views from
+ * where plain doubles run out (~1e-13 wide) down to ~1e-30 for a few times
+ * the cost of double arithmetic, without any allocation.
+ *
+ * The error-free transformations below rely on every operation being
+ * rounded on its own (Dekker's splitting instead of FMA), so code using them
+ * must be compiled with -ffp-contract=off, as the Makefile does for every
+ * object. */
+typedef struct {
+    double hi, lo;
+} dd_real;
+
+/* a + b = s + e exactly */
+static inline double dd_two_sum(double a, double b, double *e)
+{
+    double s = a + b;
+    double bb = s - a;
+    *e = (a - (s - bb)) + (b - bb);
+    return s;
+}
+
+/* As dd_two_sum() but requires |a| >= |b| */
+static inline double dd_quick_two_sum(double a, double b, double *e)
+{
+    double s = a + b;
+    *e = b - (s - a);
+    return s;
+}
+
+/* a * b = p + e exactly */
+static inline double dd_two_prod(double a, double b, double *e)
+{
+    const double split = 134217729.0;  /* 2^27 + 1 */
+    double p = a * b;
+    double t = split * a;
+    double a_hi = t - (t - a), a_lo = a - a_hi;
+    t = split * b;
+    double b_hi = t - (t - b), b_lo = b - b_hi;
+    *e = ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo;
+    return p;
+}
+
+static inline dd_real dd_from_d(double a)
+{ return (dd_real) {a, 0}; }
+
+static inline dd_real dd_from_mpfr(mpfr_t x)
+{
+    dd_real r;
+    mpfr_t rest;
+    mpfr_init2(rest, mpfr_get_prec(x));
+    r.hi = mpfr_get_d(x, MPFR_RNDN);
+    mpfr_sub_d(rest, x, r.hi, MPFR_RNDN);
+    r.lo = mpfr_get_d(rest, MPFR_RNDN);
+    mpfr_clear(rest);
+    return r;
+}
+
+static inline dd_real dd_add(dd_real a, dd_real b)
+{
+    double e;
+    double s = dd_two_sum(a.hi, b.hi, &e);
+    e += a.lo + b.lo;
+    s = dd_quick_two_sum(s, e, &e);
+    return (dd_real) {s, e};
+}
+
+static inline dd_real dd_add_d(dd_real a, double b)
+{
+    double e;
+    double s = dd_two_sum(a.hi, b, &e);
+    e += a.lo;
+    s = dd_quick_two_sum(s, e, &e);
+    return (dd_real) {s, e};
+}
+
+static inline dd_real dd_sub(dd_real a, dd_real b)
+{ return dd_add(a, (dd_real) {-b.hi, -b.lo}); }
+
+static inline dd_real dd_mul(dd_real a, dd_real b)
+{
+    double e;
+    double p = dd_two_prod(a.hi, b.hi, &e);
+    e += a.hi * b.lo + a.lo * b.hi;
+    p = dd_quick_two_sum(p, e, &e);
+    return (dd_real) {p, e};
+}
+
+static inline dd_real dd_sqr(dd_real a)
+{
+    double e;
+    double p = dd_two_prod(a.hi, a.hi, &e);
+    e += 2 * a.hi * a.lo;
+    p = dd_quick_two_sum(p, e, &e);
+    return (dd_real) {p, e};
+}
+
+/* Multiplying by 2 is exact */
+static inline dd_real dd_mul_2(dd_real a)
+{ return (dd_real) {2 * a.hi, 2 * a.lo}; }
+
+#endif
@@ -0,0 +1,898 @@
+#include <immintrin.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "escape_kernel.h"
+
+/* The vector kernels are compiled for their instruction set with function
+ * attributes rather than -m flags, so one binary carries every code path and
+ * escape_kernel_init() chooses between them on the machine it runs on.
+ *
+ * None of the kernels enable FMA: the multiplies and adds are rounded exactly
+ * like the scalar loop, so every code path produces identical images. */
+
+escape_row_func escape_row = escape_row_scalar;
+escape_row_dd_func escape_row_dd = escape_row_dd_scalar;
+static const char *kernel_name = "scalar";
+
+/* Whether c is inside the main cardioid or the period-2 bulb, where every
+ * orbit stays bounded and iterating to max_iter would be wasted. */
+static inline bool in_cardioid_or_bulb(double x, double y)
+{
+    double x_q = x - 0.25, y_2 = y * y;
+    double q = x_q * x_q + y_2;
+    if (q * (q + x_q) <= 0.25 * y_2)
+        return true;
+    return (x + 1) * (x + 1) + y_2 <= 0.0625;
+}
+
+/* Record how pixel i's orbit ended, keeping z if max_iter stopped it */
+static inline void orbit_store(struct orbit *orbits, int i, int it,
+        int max_iter, bool interior, dd_real z_real, dd_real z_imag)
+{
+    if (orbits == NULL)
+        return;
+    orbits[i].m = orbit_ended(it, max_iter, interior);
+    if (orbits[i].m == ORBIT_RESTART) {
+        orbits[i].z_real = z_real;
+        orbits[i].z_imag = z_imag;
+        orbits[i].m = 0;
+    }
+}
+
+/* Whether pixel i carries on from a kept z rather than starting at c */
+static inline bool orbit_resumes(const struct orbit *orbits, int i)
+{ return orbits != NULL && orbits[i].m >= 0; }
+
+void escape_row_scalar(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    const double eps = dx * PERIOD_TOLERANCE;
+    for (int i = 0; i < n; i++) {
+        double x = x0 + i * dx;
+        double z_real = x, z_imag = y;
+        double saved_real = MY_INFINITY, saved_imag = MY_INFINITY;
+        int it = 0, step = 0, check = 1;
+        bool periodic = false;
+        if (orbits != NULL && !orbit_pending(orbits + i, iters + i, max_iter))
+            continue;
+        if (orbit_resumes(orbits, i)) {
+            z_real = orbits[i].z_real.hi;
+            z_imag = orbits[i].z_imag.hi;
+            it = iters[i];
+        } else if (in_cardioid_or_bulb(x, y)) {
+            iters[i] = max_iter;
+            stats->in_bulb++;
+            orbit_store(orbits, i, max_iter, max_iter, true, dd_from_d(0),
+                    dd_from_d(0));
+            continue;
+        }
+        double z_real_2 = z_real * z_real, z_imag_2 = z_imag * z_imag;
+        while (z_real_2 + z_imag_2 < MY_INFINITY && it < max_iter) {
+            /* Brent: compare against z saved at power-of-two iterations */
+            if (step == check) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                check *= 2;
+            } else if (fabs(z_real - saved_real) < eps
+                    && fabs(z_imag - saved_imag) < eps) {
+                it = max_iter;
+                periodic = true;
+                stats->periodic++;
+                break;
+            }
+            it++;
+            step++;
+            /* z = z^2 + c */
+            z_imag = 2 * z_real * z_imag + y;
+            z_real = z_real_2 - z_imag_2 + x;
+            z_real_2 = z_real * z_real;
+            z_imag_2 = z_imag * z_imag;
+        }
+        iters[i] = it;
+        if (escaped_abs_2 != NULL && it < max_iter)
+            escaped_abs_2[i] = z_real_2 + z_imag_2;
+        orbit_store(orbits, i, it, max_iter, periodic, dd_from_d(z_real),
+                dd_from_d(z_imag));
+    }
+}
+
+/* Where the lanes of the group of pixels from i start: lanes with nothing
+ * to do get 0 in `pending`, resumed lanes -1 in `resumed` and their kept z
+ * and count, the rest z = c at a count of 0. */
+static inline void lanes_start(double x0, double dx, double y, int i, int n,
+        int lanes, int max_iter, int *iters, struct orbit *orbits,
+        int64_t *pending, int64_t *resumed, double *z_real, double *z_imag,
+        int64_t *it)
+{
+    for (int k = 0; k < lanes; k++) {
+        pending[k] = i + k < n && (orbits == NULL || orbit_pending(
+                    orbits + i + k, iters + i + k, max_iter)) ? -1 : 0;
+        resumed[k] = pending[k] && orbit_resumes(orbits, i + k) ? -1 : 0;
+        z_real[k] = resumed[k] ? orbits[i+k].z_real.hi : x0 + (i+k) * dx;
+        z_imag[k] = resumed[k] ? orbits[i+k].z_imag.hi : y;
+        it[k] = resumed[k] ? iters[i+k] : 0;
+    }
+}
+
+/* Write back the pending lanes of a group: counts, |z|^2 of the escaped ones
+ * and how each orbit ended, z being where it stopped */
+static inline void lanes_finish(int i, int lanes, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits, const int64_t *pending,
+        const int64_t *counts, const double *abs_2, const int64_t *interior,
+        const double *z_real, const double *z_imag)
+{
+    for (int k = 0; k < lanes; k++) {
+        if (!pending[k])
+            continue;
+        iters[i+k] = counts[k];
+        if (escaped_abs_2 != NULL && counts[k] < max_iter)
+            escaped_abs_2[i+k] = abs_2[k];
+        orbit_store(orbits, i + k, counts[k], max_iter, interior[k],
+                dd_from_d(z_real[k]), dd_from_d(z_imag[k]));
+    }
+}
+
+/* 4 pixels per lane group. Each lane keeps its own 64-bit iteration counter
+ * and drops out of the `active` mask once it escapes, hits max_iter or is
+ * found to be periodic; the group finishes when no lane is active. Active
+ * lanes have all done `step` iterations in this call, so they share the
+ * periodicity schedule of the scalar kernel. Lanes stopped by max_iter
+ * latch z, to be kept in their orbits. */
+__attribute__((target("avx2")))
+void escape_row_avx2(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    const __m256d radius = _mm256_set1_pd(MY_INFINITY);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d c_imag = _mm256_set1_pd(y);
+    const __m256d eps = _mm256_set1_pd(dx * PERIOD_TOLERANCE);
+    const __m256d abs_mask = _mm256_castsi256_pd(
+            _mm256_set1_epi64x(0x7FFFFFFFFFFFFFFF));
+    const __m256i limit = _mm256_set1_epi64x(max_iter);
+    int64_t counts[4], pending[4], resumed[4], interior[4];
+    double start_real[4], start_imag[4], escaped_lanes[4];
+
+    for (int i = 0; i < n; i += 4) {
+        __m256d c_real = _mm256_set_pd(x0 + (i+3) * dx, x0 + (i+2) * dx,
+                x0 + (i+1) * dx, x0 + i * dx);
+        /* Lanes past the end of the row start inactive */
+        lanes_start(x0, dx, y, i, n, 4, max_iter, iters, orbits, pending,
+                resumed, start_real, start_imag, counts);
+        __m256d z_real = _mm256_loadu_pd(start_real);
+        __m256d z_imag = _mm256_loadu_pd(start_imag);
+        __m256d stop_real = z_real, stop_imag = z_imag;
+        __m256d saved_real = radius, saved_imag = radius;
+        __m256d escaped = _mm256_setzero_pd();
+        __m256i it = _mm256_loadu_si256((__m256i *)counts);
+        __m256i active = _mm256_loadu_si256((__m256i *)pending);
+        int step = 0, check = 1;
+        if (_mm256_testz_si256(active, active))
+            continue;
+
+        /* Lanes in the cardioid or bulb are done before they start */
+        __m256d x_q = _mm256_sub_pd(c_real, _mm256_set1_pd(0.25));
+        __m256d y_2 = _mm256_mul_pd(c_imag, c_imag);
+        __m256d q = _mm256_add_pd(_mm256_mul_pd(x_q, x_q), y_2);
+        __m256d inside = _mm256_cmp_pd(_mm256_mul_pd(q, _mm256_add_pd(q, x_q)),
+                _mm256_mul_pd(_mm256_set1_pd(0.25), y_2), _CMP_LE_OQ);
+        __m256d x_b = _mm256_add_pd(c_real, _mm256_set1_pd(1.0));
+        inside = _mm256_or_pd(inside, _mm256_cmp_pd(_mm256_add_pd(
+                        _mm256_mul_pd(x_b, x_b), y_2), _mm256_set1_pd(0.0625),
+                    _CMP_LE_OQ));
+        __m256i done = _mm256_andnot_si256(_mm256_loadu_si256(
+                    (__m256i *)resumed), _mm256_and_si256(active,
+                    _mm256_castpd_si256(inside)));
+        __m256i found = done;  /* Lanes found interior */
+        stats->in_bulb += __builtin_popcount(_mm256_movemask_pd(
+                    _mm256_castsi256_pd(done)));
+        it = _mm256_blendv_epi8(it, limit, done);
+        active = _mm256_andnot_si256(done, active);
+
+        while (true) {
+            __m256d z_real_2 = _mm256_mul_pd(z_real, z_real);
+            __m256d z_imag_2 = _mm256_mul_pd(z_imag, z_imag);
+            __m256d abs_2 = _mm256_add_pd(z_real_2, z_imag_2);
+            __m256d bounded = _mm256_cmp_pd(abs_2, radius, _CMP_LT_OQ);
+            /* Keep |z|^2 of the lanes escaping now */
+            escaped = _mm256_blendv_pd(escaped, abs_2, _mm256_andnot_pd(
+                        bounded, _mm256_castsi256_pd(active)));
+            active = _mm256_and_si256(active, _mm256_castpd_si256(bounded));
+            done = _mm256_andnot_si256(_mm256_cmpgt_epi64(limit, it), active);
+            if (!_mm256_testz_si256(done, done)) {
+                stop_real = _mm256_blendv_pd(stop_real, z_real,
+                        _mm256_castsi256_pd(done));
+                stop_imag = _mm256_blendv_pd(stop_imag, z_imag,
+                        _mm256_castsi256_pd(done));
+                active = _mm256_andnot_si256(done, active);
+            }
+            if (_mm256_testz_si256(active, active))
+                break;
+            if (step == check) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                check *= 2;
+            } else {
+                __m256d close = _mm256_and_pd(
+                        _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(z_real,
+                                    saved_real), abs_mask), eps, _CMP_LT_OQ),
+                        _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(z_imag,
+                                    saved_imag), abs_mask), eps, _CMP_LT_OQ));
+                done = _mm256_and_si256(active, _mm256_castpd_si256(close));
+                if (!_mm256_testz_si256(done, done)) {
+                    stats->periodic += __builtin_popcount(_mm256_movemask_pd(
+                                _mm256_castsi256_pd(done)));
+                    it = _mm256_blendv_epi8(it, limit, done);
+                    found = _mm256_or_si256(found, done);
+                    active = _mm256_andnot_si256(done, active);
+                    if (_mm256_testz_si256(active, active))
+                        break;
+                }
+            }
+            step++;
+            /* Active lanes are all-ones (-1), so subtracting counts them */
+            it = _mm256_sub_epi64(it, active);
+            __m256d z_imag_new = _mm256_add_pd(_mm256_mul_pd(
+                        _mm256_mul_pd(two, z_real), z_imag), c_imag);
+            z_real = _mm256_add_pd(_mm256_sub_pd(z_real_2, z_imag_2), c_real);
+            z_imag = z_imag_new;
+        }
+        _mm256_storeu_si256((__m256i *)counts, it);
+        _mm256_storeu_si256((__m256i *)interior, found);
+        _mm256_storeu_pd(escaped_lanes, escaped);
+        _mm256_storeu_pd(start_real, stop_real);
+        _mm256_storeu_pd(start_imag, stop_imag);
+        lanes_finish(i, 4, max_iter, iters, escaped_abs_2, orbits, pending,
+                counts, escaped_lanes, interior, start_real, start_imag);
+    }
+}
+
+/* 8 pixels per lane group, using AVX-512 mask registers for the per-lane
+ * escape state. */
+__attribute__((target("avx512f")))
+void escape_row_avx512(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    const __m512d radius = _mm512_set1_pd(MY_INFINITY);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d c_imag = _mm512_set1_pd(y);
+    const __m512d eps = _mm512_set1_pd(dx * PERIOD_TOLERANCE);
+    const __m512d lane = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i limit = _mm512_set1_epi64(max_iter);
+    const __m512i one = _mm512_set1_epi64(1);
+    int64_t counts[8], pending[8], resumed[8], interior[8];
+    double start_real[8], start_imag[8], escaped_lanes[8];
+
+    for (int i = 0; i < n; i += 8) {
+        __m512d c_real = _mm512_add_pd(_mm512_set1_pd(x0),
+                _mm512_mul_pd(_mm512_add_pd(lane, _mm512_set1_pd(i)),
+                    _mm512_set1_pd(dx)));
+        lanes_start(x0, dx, y, i, n, 8, max_iter, iters, orbits, pending,
+                resumed, start_real, start_imag, counts);
+        __m512d z_real = _mm512_loadu_pd(start_real);
+        __m512d z_imag = _mm512_loadu_pd(start_imag);
+        __m512d stop_real = z_real, stop_imag = z_imag;
+        __m512d saved_real = radius, saved_imag = radius;
+        __m512d escaped = _mm512_setzero_pd();
+        __m512i it = _mm512_loadu_si512(counts);
+        __mmask8 active = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(
+                    pending), _mm512_setzero_si512());
+        __mmask8 fresh = active & ~_mm512_cmpneq_epi64_mask(
+                _mm512_loadu_si512(resumed), _mm512_setzero_si512());
+        __mmask8 done, found;
+        int step = 0, check = 1;
+        if (active == 0)
+            continue;
+
+        /* Lanes in the cardioid or bulb are done before they start */
+        __m512d x_q = _mm512_sub_pd(c_real, _mm512_set1_pd(0.25));
+        __m512d y_2 = _mm512_mul_pd(c_imag, c_imag);
+        __m512d q = _mm512_add_pd(_mm512_mul_pd(x_q, x_q), y_2);
+        __m512d x_b = _mm512_add_pd(c_real, _mm512_set1_pd(1.0));
+        done = _mm512_mask_cmp_pd_mask(fresh, _mm512_mul_pd(q,
+                    _mm512_add_pd(q, x_q)), _mm512_mul_pd(
+                    _mm512_set1_pd(0.25), y_2), _CMP_LE_OQ);
+        done |= _mm512_mask_cmp_pd_mask(fresh, _mm512_add_pd(
+                    _mm512_mul_pd(x_b, x_b), y_2), _mm512_set1_pd(0.0625),
+                _CMP_LE_OQ);
+        found = done;  /* Lanes found interior */
+        stats->in_bulb += __builtin_popcount(done);
+        it = _mm512_mask_mov_epi64(it, done, limit);
+        active &= ~done;
+
+        while (true) {
+            __m512d z_real_2 = _mm512_mul_pd(z_real, z_real);
+            __m512d z_imag_2 = _mm512_mul_pd(z_imag, z_imag);
+            __m512d abs_2 = _mm512_add_pd(z_real_2, z_imag_2);
+            __mmask8 bounded = _mm512_mask_cmp_pd_mask(active, abs_2, radius,
+                    _CMP_LT_OQ);
+            /* Keep |z|^2 of the lanes escaping now */
+            escaped = _mm512_mask_mov_pd(escaped, active & ~bounded, abs_2);
+            active = bounded;
+            done = _mm512_mask_cmpge_epi64_mask(active, it, limit);
+            if (done != 0) {
+                stop_real = _mm512_mask_mov_pd(stop_real, done, z_real);
+                stop_imag = _mm512_mask_mov_pd(stop_imag, done, z_imag);
+                active &= ~done;
+            }
+            if (active == 0)
+                break;
+            if (step == check) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                check *= 2;
+            } else {
+                done = _mm512_mask_cmp_pd_mask(active, _mm512_abs_pd(
+                            _mm512_sub_pd(z_real, saved_real)), eps,
+                        _CMP_LT_OQ);
+                done = _mm512_mask_cmp_pd_mask(done, _mm512_abs_pd(
+                            _mm512_sub_pd(z_imag, saved_imag)), eps,
+                        _CMP_LT_OQ);
+                if (done != 0) {
+                    stats->periodic += __builtin_popcount(done);
+                    it = _mm512_mask_mov_epi64(it, done, limit);
+                    found |= done;
+                    active &= ~done;
+                    if (active == 0)
+                        break;
+                }
+            }
+            step++;
+            it = _mm512_mask_add_epi64(it, active, it, one);
+            __m512d z_imag_new = _mm512_add_pd(_mm512_mul_pd(
+                        _mm512_mul_pd(two, z_real), z_imag), c_imag);
+            z_real = _mm512_add_pd(_mm512_sub_pd(z_real_2, z_imag_2), c_real);
+            z_imag = z_imag_new;
+        }
+        _mm512_storeu_si512(counts, it);
+        _mm512_storeu_si512(interior, _mm512_maskz_set1_epi64(found, -1));
+        _mm512_storeu_pd(escaped_lanes, escaped);
+        _mm512_storeu_pd(start_real, stop_real);
+        _mm512_storeu_pd(start_imag, stop_imag);
+        lanes_finish(i, 8, max_iter, iters, escaped_abs_2, orbits, pending,
+                counts, escaped_lanes, interior, start_real, start_imag);
+    }
+}
+
+/* in_cardioid_or_bulb() in double-double, for views too deep for the
+ * double test to be trusted near the boundary */
+static inline bool dd_in_cardioid_or_bulb(dd_real x, dd_real y)
+{
+    dd_real x_q = dd_add_d(x, -0.25), y_2 = dd_sqr(y);
+    dd_real q = dd_add(dd_sqr(x_q), y_2);
+    dd_real quarter_y_2 = {0.25 * y_2.hi, 0.25 * y_2.lo};
+    if (dd_sub(dd_mul(q, dd_add(q, x_q)), quarter_y_2).hi <= 0)
+        return true;
+    dd_real x_b = dd_add_d(x, 1);
+    return dd_add_d(dd_add(dd_sqr(x_b), y_2), -0.0625).hi <= 0;
+}
+
+void escape_row_dd_scalar(dd_real x0, double dx, dd_real y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    const double eps = dx * PERIOD_TOLERANCE;
+    for (int i = 0; i < n; i++) {
+        dd_real x = dd_add_d(x0, i * dx);
+        dd_real z_real = x, z_imag = y;
+        dd_real saved_real = dd_from_d(MY_INFINITY), saved_imag = saved_real;
+        int it = 0, step = 0, check = 1;
+        bool periodic = false;
+        if (orbits != NULL && !orbit_pending(orbits + i, iters + i, max_iter))
+            continue;
+        if (orbit_resumes(orbits, i)) {
+            z_real = orbits[i].z_real;
+            z_imag = orbits[i].z_imag;
+            it = iters[i];
+        } else if (dd_in_cardioid_or_bulb(x, y)) {
+            iters[i] = max_iter;
+            stats->in_bulb++;
+            orbit_store(orbits, i, max_iter, max_iter, true, dd_from_d(0),
+                    dd_from_d(0));
+            continue;
+        }
+        dd_real z_real_2 = dd_sqr(z_real), z_imag_2 = dd_sqr(z_imag);
+        while (z_real_2.hi + z_imag_2.hi < MY_INFINITY && it < max_iter) {
+            if (step == check) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                check *= 2;
+            } else if (fabs(dd_sub(z_real, saved_real).hi) < eps
+                    && fabs(dd_sub(z_imag, saved_imag).hi) < eps) {
+                it = max_iter;
+                periodic = true;
+                stats->periodic++;
+                break;
+            }
+            it++;
+            step++;
+            /* z = z^2 + c */
+            z_imag = dd_add(dd_mul(dd_mul_2(z_real), z_imag), y);
+            z_real = dd_add(dd_sub(z_real_2, z_imag_2), x);
+            z_real_2 = dd_sqr(z_real);
+            z_imag_2 = dd_sqr(z_imag);
+        }
+        iters[i] = it;
+        if (escaped_abs_2 != NULL && it < max_iter)
+            escaped_abs_2[i] = z_real_2.hi + z_imag_2.hi;
+        orbit_store(orbits, i, it, max_iter, periodic, z_real, z_imag);
+    }
+}
+
+/* Four double-double lanes: the hi and lo parts each fill a __m256d. These
+ * mirror the scalar operations in double-double.h. */
+typedef struct {
+    __m256d hi, lo;
+} dd4_real;
+
+#define AVX2_INLINE static inline __attribute__((always_inline, target("avx2")))
+
+AVX2_INLINE __m256d dd4_two_sum(__m256d a, __m256d b, __m256d *e)
+{
+    __m256d s = _mm256_add_pd(a, b);
+    __m256d bb = _mm256_sub_pd(s, a);
+    *e = _mm256_add_pd(_mm256_sub_pd(a, _mm256_sub_pd(s, bb)),
+            _mm256_sub_pd(b, bb));
+    return s;
+}
+
+AVX2_INLINE __m256d dd4_quick_two_sum(__m256d a, __m256d b, __m256d *e)
+{
+    __m256d s = _mm256_add_pd(a, b);
+    *e = _mm256_sub_pd(b, _mm256_sub_pd(s, a));
+    return s;
+}
+
+AVX2_INLINE __m256d dd4_two_prod(__m256d a, __m256d b, __m256d *e)
+{
+    const __m256d split = _mm256_set1_pd(134217729.0);
+    __m256d p = _mm256_mul_pd(a, b);
+    __m256d t = _mm256_mul_pd(split, a);
+    __m256d a_hi = _mm256_sub_pd(t, _mm256_sub_pd(t, a));
+    __m256d a_lo = _mm256_sub_pd(a, a_hi);
+    t = _mm256_mul_pd(split, b);
+    __m256d b_hi = _mm256_sub_pd(t, _mm256_sub_pd(t, b));
+    __m256d b_lo = _mm256_sub_pd(b, b_hi);
+    __m256d err = _mm256_sub_pd(_mm256_mul_pd(a_hi, b_hi), p);
+    err = _mm256_add_pd(err, _mm256_mul_pd(a_hi, b_lo));
+    err = _mm256_add_pd(err, _mm256_mul_pd(a_lo, b_hi));
+    *e = _mm256_add_pd(err, _mm256_mul_pd(a_lo, b_lo));
+    return p;
+}
+
+AVX2_INLINE dd4_real dd4_add(dd4_real a, dd4_real b)
+{
+    __m256d e;
+    __m256d s = dd4_two_sum(a.hi, b.hi, &e);
+    e = _mm256_add_pd(e, _mm256_add_pd(a.lo, b.lo));
+    s = dd4_quick_two_sum(s, e, &e);
+    return (dd4_real) {s, e};
+}
+
+AVX2_INLINE dd4_real dd4_sub(dd4_real a, dd4_real b)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    b.hi = _mm256_xor_pd(b.hi, sign);
+    b.lo = _mm256_xor_pd(b.lo, sign);
+    return dd4_add(a, b);
+}
+
+AVX2_INLINE dd4_real dd4_mul(dd4_real a, dd4_real b)
+{
+    __m256d e;
+    __m256d p = dd4_two_prod(a.hi, b.hi, &e);
+    e = _mm256_add_pd(e, _mm256_add_pd(_mm256_mul_pd(a.hi, b.lo),
+                _mm256_mul_pd(a.lo, b.hi)));
+    p = dd4_quick_two_sum(p, e, &e);
+    return (dd4_real) {p, e};
+}
+
+AVX2_INLINE dd4_real dd4_sqr(dd4_real a)
+{
+    __m256d e;
+    __m256d p = dd4_two_prod(a.hi, a.hi, &e);
+    __m256d cross = _mm256_mul_pd(a.hi, a.lo);
+    e = _mm256_add_pd(e, _mm256_add_pd(cross, cross));
+    p = dd4_quick_two_sum(p, e, &e);
+    return (dd4_real) {p, e};
+}
+
+/* Lanes stopped by max_iter latch z as in escape_row_avx2() */
+__attribute__((target("avx2")))
+void escape_row_dd_avx2(dd_real x0, double dx, dd_real y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    const __m256d radius = _mm256_set1_pd(MY_INFINITY);
+    const __m256d eps = _mm256_set1_pd(dx * PERIOD_TOLERANCE);
+    const __m256d abs_mask = _mm256_castsi256_pd(
+            _mm256_set1_epi64x(0x7FFFFFFFFFFFFFFF));
+    const dd4_real c_imag = {_mm256_set1_pd(y.hi), _mm256_set1_pd(y.lo)};
+    const __m256i limit = _mm256_set1_epi64x(max_iter);
+    int64_t counts[4], pending[4], interior[4];
+    double escaped_lanes[4];
+
+    for (int i = 0; i < n; i += 4) {
+        dd_real x[4], start_real[4], start_imag[4];
+        int64_t inside[4];
+        for (int k = 0; k < 4; k++) {
+            x[k] = dd_add_d(x0, (i+k) * dx);
+            pending[k] = i + k < n && (orbits == NULL || orbit_pending(
+                        orbits + i + k, iters + i + k, max_iter)) ? -1 : 0;
+            bool resumed = pending[k] && orbit_resumes(orbits, i + k);
+            start_real[k] = resumed ? orbits[i+k].z_real : x[k];
+            start_imag[k] = resumed ? orbits[i+k].z_imag : y;
+            counts[k] = resumed ? iters[i+k] : 0;
+            inside[k] = pending[k] && !resumed
+                && dd_in_cardioid_or_bulb(x[k], y) ? -1 : 0;
+        }
+        dd4_real c_real = {
+            _mm256_set_pd(x[3].hi, x[2].hi, x[1].hi, x[0].hi),
+            _mm256_set_pd(x[3].lo, x[2].lo, x[1].lo, x[0].lo),
+        };
+        dd4_real z_real = {
+            _mm256_set_pd(start_real[3].hi, start_real[2].hi,
+                    start_real[1].hi, start_real[0].hi),
+            _mm256_set_pd(start_real[3].lo, start_real[2].lo,
+                    start_real[1].lo, start_real[0].lo),
+        };
+        dd4_real z_imag = {
+            _mm256_set_pd(start_imag[3].hi, start_imag[2].hi,
+                    start_imag[1].hi, start_imag[0].hi),
+            _mm256_set_pd(start_imag[3].lo, start_imag[2].lo,
+                    start_imag[1].lo, start_imag[0].lo),
+        };
+        dd4_real stop_real = z_real, stop_imag = z_imag;
+        dd4_real saved_real = {radius, _mm256_setzero_pd()};
+        dd4_real saved_imag = saved_real;
+        __m256d escaped = _mm256_setzero_pd();
+        __m256i it = _mm256_loadu_si256((__m256i *)counts);
+        __m256i active = _mm256_loadu_si256((__m256i *)pending);
+        int step = 0, check = 1;
+        if (_mm256_testz_si256(active, active))
+            continue;
+        __m256i done = _mm256_loadu_si256((__m256i *)inside);
+        __m256i found = done;  /* Lanes found interior */
+        stats->in_bulb += __builtin_popcount(_mm256_movemask_pd(
+                    _mm256_castsi256_pd(done)));
+        it = _mm256_blendv_epi8(it, limit, done);
+        active = _mm256_andnot_si256(done, active);
+        while (true) {
+            dd4_real z_real_2 = dd4_sqr(z_real);
+            dd4_real z_imag_2 = dd4_sqr(z_imag);
+            __m256d abs_2 = _mm256_add_pd(z_real_2.hi, z_imag_2.hi);
+            __m256d bounded = _mm256_cmp_pd(abs_2, radius, _CMP_LT_OQ);
+            escaped = _mm256_blendv_pd(escaped, abs_2, _mm256_andnot_pd(
+                        bounded, _mm256_castsi256_pd(active)));
+            active = _mm256_and_si256(active, _mm256_castpd_si256(bounded));
+            done = _mm256_andnot_si256(_mm256_cmpgt_epi64(limit, it), active);
+            if (!_mm256_testz_si256(done, done)) {
+                __m256d stopped = _mm256_castsi256_pd(done);
+                stop_real.hi = _mm256_blendv_pd(stop_real.hi, z_real.hi,
+                        stopped);
+                stop_real.lo = _mm256_blendv_pd(stop_real.lo, z_real.lo,
+                        stopped);
+                stop_imag.hi = _mm256_blendv_pd(stop_imag.hi, z_imag.hi,
+                        stopped);
+                stop_imag.lo = _mm256_blendv_pd(stop_imag.lo, z_imag.lo,
+                        stopped);
+                active = _mm256_andnot_si256(done, active);
+            }
+            if (_mm256_testz_si256(active, active))
+                break;
+            if (step == check) {
+                saved_real = z_real;
+                saved_imag = z_imag;
+                check *= 2;
+            } else {
+                __m256d close = _mm256_and_pd(
+                        _mm256_cmp_pd(_mm256_and_pd(dd4_sub(z_real,
+                                    saved_real).hi, abs_mask), eps, _CMP_LT_OQ),
+                        _mm256_cmp_pd(_mm256_and_pd(dd4_sub(z_imag,
+                                    saved_imag).hi, abs_mask), eps, _CMP_LT_OQ));
+                done = _mm256_and_si256(active, _mm256_castpd_si256(close));
+                if (!_mm256_testz_si256(done, done)) {
+                    stats->periodic += __builtin_popcount(_mm256_movemask_pd(
+                                _mm256_castsi256_pd(done)));
+                    it = _mm256_blendv_epi8(it, limit, done);
+                    found = _mm256_or_si256(found, done);
+                    active = _mm256_andnot_si256(done, active);
+                    if (_mm256_testz_si256(active, active))
+                        break;
+                }
+            }
+            step++;
+            it = _mm256_sub_epi64(it, active);
+            dd4_real two_z_real = {_mm256_add_pd(z_real.hi, z_real.hi),
+                _mm256_add_pd(z_real.lo, z_real.lo)};
+            z_imag = dd4_add(dd4_mul(two_z_real, z_imag), c_imag);
+            z_real = dd4_add(dd4_sub(z_real_2, z_imag_2), c_real);
+        }
+        double stop[4][4];
+        _mm256_storeu_si256((__m256i *)counts, it);
+        _mm256_storeu_si256((__m256i *)interior, found);
+        _mm256_storeu_pd(escaped_lanes, escaped);
+        _mm256_storeu_pd(stop[0], stop_real.hi);
+        _mm256_storeu_pd(stop[1], stop_real.lo);
+        _mm256_storeu_pd(stop[2], stop_imag.hi);
+        _mm256_storeu_pd(stop[3], stop_imag.lo);
+        for (int k = 0; k < 4; k++) {
+            if (!pending[k])
+                continue;
+            iters[i+k] = counts[k];
+            if (escaped_abs_2 != NULL && counts[k] < max_iter)
+                escaped_abs_2[i+k] = escaped_lanes[k];
+            orbit_store(orbits, i + k, counts[k], max_iter, interior[k],
+                    (dd_real) {stop[0][k], stop[1][k]},
+                    (dd_real) {stop[2][k], stop[3][k]});
+        }
+    }
+}
+
+/* Signed z = a + b on `limbs`-limb magnitudes. z may be the same as a or b. */
+static inline __attribute__((always_inline))
+int mpn_fixed_add(mp_limb_t *z, const mp_limb_t *a, int a_sign,
+        const mp_limb_t *b, int b_sign, int limbs)
+{
+    if (b_sign == 0) {
+        if (z != a)
+            mpn_copyi(z, a, limbs);
+        return a_sign;
+    }
+    if (a_sign == 0) {
+        if (z != b)
+            mpn_copyi(z, b, limbs);
+        return b_sign;
+    }
+    if (a_sign == b_sign) {
+        mpn_add_n(z, a, b, limbs);
+        return a_sign;
+    }
+    int cmp = mpn_cmp(a, b, limbs);
+    if (cmp == 0) {
+        mpn_zero(z, limbs);
+        return 0;
+    }
+    if (cmp > 0) {
+        mpn_sub_n(z, a, b, limbs);
+        return a_sign;
+    }
+    mpn_sub_n(z, b, a, limbs);
+    return b_sign;
+}
+
+/* Signed z = a*b, truncated. z may be the same as a or b. */
+static inline __attribute__((always_inline))
+int mpn_fixed_mul(mp_limb_t *z, const mp_limb_t *a, int a_sign,
+        const mp_limb_t *b, int b_sign, int limbs)
+{
+    mp_limb_t prod[2*MPN_MAX_LIMBS];
+    if (a == b)
+        mpn_sqr(prod, a, limbs);
+    else
+        mpn_mul_n(prod, a, b, limbs);
+    mpn_copyi(z, prod + limbs - 1, limbs);
+    return a_sign * b_sign;
+}
+
+/* Position of the highest set bit relative to the binary point, so that
+ * 2^msb <= |a| < 2^(msb+1); INT_MIN for zero */
+static inline __attribute__((always_inline))
+int mpn_fixed_msb(const mp_limb_t *a, int limbs)
+{
+    for (int j = limbs - 1; j >= 0; j--)
+        if (a[j] != 0)
+            return GMP_NUMB_BITS * (j - limbs + 1) + GMP_NUMB_BITS - 1
+                - __builtin_clzl(a[j]);
+    return INT_MIN;
+}
+
+static inline __attribute__((always_inline))
+bool mpn_in_cardioid_or_bulb(const mp_limb_t *x, int x_sign,
+        const mp_limb_t *y, int y_sign, int limbs)
+{
+    mp_limb_t x_q[MPN_MAX_LIMBS], y_2[MPN_MAX_LIMBS], q[MPN_MAX_LIMBS];
+    mp_limb_t t[MPN_MAX_LIMBS], c[MPN_MAX_LIMBS];
+    int x_q_sign, y_2_sign, q_sign, t_sign;
+    /* x_q = x - 1/4 */
+    mpn_zero(c, limbs);
+    c[limbs-2] = (mp_limb_t) 1 << (GMP_NUMB_BITS - 2);
+    x_q_sign = mpn_fixed_add(x_q, x, x_sign, c, -1, limbs);
+    y_2_sign = mpn_fixed_mul(y_2, y, y_sign, y, y_sign, limbs);
+    /* q = x_q^2 + y^2; inside the cardioid if q*(q + x_q) <= y^2/4 */
+    q_sign = mpn_fixed_mul(q, x_q, x_q_sign, x_q, x_q_sign, limbs);
+    q_sign = mpn_fixed_add(q, q, q_sign, y_2, y_2_sign, limbs);
+    t_sign = mpn_fixed_add(t, q, q_sign, x_q, x_q_sign, limbs);
+    t_sign = mpn_fixed_mul(t, q, q_sign, t, t_sign, limbs);
+    mpn_rshift(c, y_2, limbs, 2);
+    if (mpn_fixed_add(t, t, t_sign, c, -y_2_sign, limbs) <= 0)
+        return true;
+    /* Inside the bulb if (x + 1)^2 + y^2 <= 1/16 */
+    mpn_zero(c, limbs);
+    c[limbs-1] = 1;
+    t_sign = mpn_fixed_add(t, x, x_sign, c, 1, limbs);
+    t_sign = mpn_fixed_mul(t, t, t_sign, t, t_sign, limbs);
+    t_sign = mpn_fixed_add(t, t, t_sign, y_2, y_2_sign, limbs);
+    c[limbs-1] = 0;
+    c[limbs-2] = (mp_limb_t) 1 << (GMP_NUMB_BITS - 4);
+    return mpn_fixed_add(t, t, t_sign, c, -1, limbs) <= 0;
+}
+
+/* The body of escape_row_mpn() for a constant limb count, so the compiler
+ * can unroll the copies and drop the bookkeeping for other widths. Products
+ * are 2*limbs long; the limbs lining up with the operands are
+ * p[limbs-1 .. 2*limbs-2], the top one only holding integral bits a bounded
+ * orbit never reaches. */
+static inline __attribute__((always_inline))
+void escape_row_mpn_n(const struct mpn_fixed *x0, const struct mpn_fixed *dx,
+        const struct mpn_fixed *y, int n, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats, const int limbs)
+{
+    mp_limb_t x[MPN_MAX_LIMBS], z_real[MPN_MAX_LIMBS], z_imag[MPN_MAX_LIMBS];
+    mp_limb_t abs_2[MPN_MAX_LIMBS], diff[MPN_MAX_LIMBS];
+    mp_limb_t saved_real[MPN_MAX_LIMBS], saved_imag[MPN_MAX_LIMBS];
+    mp_limb_t z_real_2[2*MPN_MAX_LIMBS], z_imag_2[2*MPN_MAX_LIMBS];
+    mp_limb_t prod[2*MPN_MAX_LIMBS];
+    /* Views of the products' fixed-point limbs */
+    mp_limb_t *zr2 = z_real_2 + limbs - 1, *zi2 = z_imag_2 + limbs - 1;
+    mp_limb_t *zri = prod + limbs - 1;
+    /* Orbits within dx*PERIOD_TOLERANCE of an earlier point are periodic */
+    const int tolerance = mpn_fixed_msb(dx->m, limbs)
+        + ilogb(PERIOD_TOLERANCE);
+
+    for (int i = 0; i < n; i++) {
+        /* x = x0 + i*dx */
+        mpn_mul_1(x, dx->m, limbs, i);
+        int x_sign = mpn_fixed_add(x, x0->m, x0->sign, x, i == 0 ? 0
+                : dx->sign, limbs);
+        int zr_sign = x_sign, zi_sign = y->sign;
+        int saved_real_sign = 0, saved_imag_sign = 0;
+        int it = 0, check = 1;
+        bool periodic = false;
+        /* Nothing is kept to resume from, so pending orbits start again */
+        if (orbits != NULL && !orbit_pending(orbits + i, iters + i, max_iter))
+            continue;
+        if (mpn_in_cardioid_or_bulb(x, x_sign, y->m, y->sign, limbs)) {
+            iters[i] = max_iter;
+            stats->in_bulb++;
+            if (orbits != NULL)
+                orbits[i].m = ORBIT_INTERIOR;
+            continue;
+        }
+        mpn_copyi(z_real, x, limbs);
+        mpn_copyi(z_imag, y->m, limbs);
+        mpn_sqr(z_real_2, z_real, limbs);
+        mpn_sqr(z_imag_2, z_imag, limbs);
+        while (true) {
+            /* |z|^2 < 4, where a carry out of the integral limb means >= 4 */
+            if (mpn_add_n(abs_2, zr2, zi2, limbs) != 0
+                    || abs_2[limbs-1] >= MY_INFINITY || it >= max_iter)
+                break;
+            if (it == check) {
+                mpn_copyi(saved_real, z_real, limbs);
+                mpn_copyi(saved_imag, z_imag, limbs);
+                saved_real_sign = zr_sign;
+                saved_imag_sign = zi_sign;
+                check *= 2;
+            } else if (it > 1) {
+                mpn_fixed_add(diff, z_real, zr_sign, saved_real,
+                        -saved_real_sign, limbs);
+                if (mpn_fixed_msb(diff, limbs) < tolerance) {
+                    mpn_fixed_add(diff, z_imag, zi_sign, saved_imag,
+                            -saved_imag_sign, limbs);
+                    if (mpn_fixed_msb(diff, limbs) < tolerance) {
+                        it = max_iter;
+                        periodic = true;
+                        stats->periodic++;
+                        break;
+                    }
+                }
+            }
+            it++;
+            /* z_imag = 2*z_real*z_imag + y */
+            mpn_mul_n(prod, z_real, z_imag, limbs);
+            mpn_lshift(zri, zri, limbs, 1);
+            zi_sign = mpn_fixed_add(z_imag, zri, zr_sign * zi_sign, y->m,
+                    y->sign, limbs);
+            /* z_real = z_real^2 - z_imag^2 + x */
+            zr_sign = mpn_fixed_add(z_real, zr2, 1, zi2, -1, limbs);
+            zr_sign = mpn_fixed_add(z_real, z_real, zr_sign, x, x_sign,
+                    limbs);
+            mpn_sqr(z_real_2, z_real, limbs);
+            mpn_sqr(z_imag_2, z_imag, limbs);
+        }
+        iters[i] = it;
+        if (escaped_abs_2 != NULL && it < max_iter)
+            escaped_abs_2[i] = zr2[limbs-1] + zi2[limbs-1]
+                + ldexp((double) zr2[limbs-2] + zi2[limbs-2], -GMP_NUMB_BITS);
+        if (orbits != NULL)
+            orbits[i].m = orbit_ended(it, max_iter, periodic);
+    }
+}
+
+void escape_row_mpn(const struct mpn_fixed *x0, const struct mpn_fixed *dx,
+        const struct mpn_fixed *y, int limbs, int n, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats)
+{
+    switch (limbs) {
+        case 2: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 2); break;
+        case 3: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 3); break;
+        case 4: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 4); break;
+        case 5: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 5); break;
+        case 6: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 6); break;
+        case 7: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 7); break;
+        case 8: escape_row_mpn_n(x0, dx, y, n, max_iter, iters,
+                        escaped_abs_2, orbits, stats, 8); break;
+    }
+}
+
+int mpn_fixed_limbs(long precision)
+{
+    /* Coordinates need 2 integral bits; the rest goes below the point */
+    int limbs = 1 + (precision - 2 + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    if (limbs < 2)
+        limbs = 2;
+    return limbs <= MPN_MAX_LIMBS ? limbs : 0;
+}
+
+void mpn_fixed_from_mpfr(struct mpn_fixed *z, mpfr_t x, int limbs)
+{
+    mpfr_t rest;
+    mpfr_init2(rest, mpfr_get_prec(x));
+    mpfr_abs(rest, x, MPFR_RNDN);
+    /* Truncate the bits below the last limb, most significant limb first */
+    for (int i = limbs - 1; i >= 0; i--) {
+        mpfr_t limb;
+        mpfr_init2(limb, GMP_NUMB_BITS);
+        mpfr_trunc(limb, rest);
+        z->m[i] = mpfr_get_ui(limb, MPFR_RNDZ);
+        mpfr_sub(rest, rest, limb, MPFR_RNDN);
+        mpfr_mul_2ui(rest, rest, GMP_NUMB_BITS, MPFR_RNDN);
+        mpfr_clear(limb);
+    }
+    mpfr_clear(rest);
+    z->sign = mpn_zero_p(z->m, limbs) ? 0 : mpfr_sgn(x) > 0 ? 1 : -1;
+}
+
+/* z = a + k*b */
+void mpn_fixed_add_mul(struct mpn_fixed *z, const struct mpn_fixed *a,
+        const struct mpn_fixed *b, unsigned long k, int limbs)
+{
+    mp_limb_t t[MPN_MAX_LIMBS];
+    mpn_mul_1(t, b->m, limbs, k);
+    z->sign = mpn_fixed_add(z->m, a->m, a->sign, t, k == 0 ? 0 : b->sign,
+            limbs);
+}
+
+void escape_kernel_init(void)
+{
+    __builtin_cpu_init();
+    escape_row_dd = __builtin_cpu_supports("avx2") ? escape_row_dd_avx2
+        : escape_row_dd_scalar;
+    if (__builtin_cpu_supports("avx512f")) {
+        escape_row = escape_row_avx512;
+        kernel_name = "AVX-512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        escape_row = escape_row_avx2;
+        kernel_name = "AVX2";
+    } else {
+        escape_row = escape_row_scalar;
+        kernel_name = "scalar";
+    }
+}
+
+const char *escape_kernel_name(void)
+{ return kernel_name; }
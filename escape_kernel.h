@@ -0,0 +1,134 @@
+#ifndef __ESCAPE_KERNEL_H
+#define __ESCAPE_KERNEL_H
+
+#include <stdbool.h>
+
+#include "double-double.h"
+
+/* Squared escape radius: a point has escaped once |z|^2 >= MY_INFINITY */
+#define MY_INFINITY 4
+
+/* An orbit that comes back within dx*PERIOD_TOLERANCE of a point it visited
+ * before is taken to have settled into a cycle, so the pixel is interior. */
+#define PERIOD_TOLERANCE (1.0 / 1024)
+
+/* Pixels a kernel found to be interior without iterating to max_iter. Each
+ * kernel call adds to the counts. */
+struct escape_stats {
+    long in_bulb;   /* Inside the main cardioid or the period-2 bulb */
+    long periodic;  /* Orbit caught in a cycle by periodicity checking */
+};
+
+/* How far a pixel's orbit has got, so raising max_iter can carry it on
+ * instead of iterating from the start. m is one of the ORBIT_* states, or
+ * for an orbit that was stopped by max_iter, z after iters[i] iterations is
+ * kept: with m = 0, or for a perturbed pixel the delta dz from reference
+ * index m. */
+struct orbit {
+    dd_real z_real, z_imag;
+    int m;
+};
+
+#define ORBIT_ESCAPED -1   /* The count is final */
+#define ORBIT_INTERIOR -2  /* Found interior: the pixel never escapes */
+#define ORBIT_RESTART -3   /* Stopped by max_iter without keeping z */
+
+/* Whether a pixel at count *it with orbit `o` has iterations left to do
+ * before max_iter. Interior pixels are brought up to max_iter instead. */
+static inline bool orbit_pending(const struct orbit *o, int *it,
+        int max_iter)
+{
+    if (o->m == ORBIT_ESCAPED)
+        return false;
+    if (o->m == ORBIT_INTERIOR) {
+        if (*it < max_iter)
+            *it = max_iter;
+        return false;
+    }
+    return *it < max_iter;
+}
+
+/* The state of an orbit that ended at count `it` without keeping z */
+static inline int orbit_ended(int it, int max_iter, bool interior)
+{
+    return it < max_iter ? ORBIT_ESCAPED : interior ? ORBIT_INTERIOR
+        : ORBIT_RESTART;
+}
+
+/* Compute the escape-time iteration count of `n` pixels along one row of the
+ * view. Pixel i samples c = (x0 + i*dx) + y*I and its count is written to
+ * iters[i]. Points in the main cardioid or period-2 bulb are counted as
+ * max_iter without iterating, as are orbits found to be periodic.
+ *
+ * For smooth colouring, escaped_abs_2[i] is set to |z|^2 just after pixel i
+ * escaped, unless it didn't escape or escaped_abs_2 is NULL.
+ *
+ * If orbits isn't NULL, pixel i carries on from orbits[i] and iters[i]
+ * (see orbit_pending()) and its orbit is updated; pixels with nothing left
+ * to do are left alone. A fresh row needs every orbit set to ORBIT_RESTART
+ * with a count of 0. */
+typedef void (*escape_row_func)(double x0, double dx, double y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+
+/* The row kernel selected by escape_kernel_init() (scalar until then). */
+extern escape_row_func escape_row;
+
+void escape_row_scalar(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+void escape_row_avx2(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+void escape_row_avx512(double x0, double dx, double y, int n, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+
+/* The same in double-double arithmetic, for views too deep for doubles.
+ * Only the row's start needs the extra precision; the pixel spacing is
+ * a double. */
+typedef void (*escape_row_dd_func)(dd_real x0, double dx, dd_real y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+
+extern escape_row_dd_func escape_row_dd;
+
+void escape_row_dd_scalar(dd_real x0, double dx, dd_real y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+void escape_row_dd_avx2(dd_real x0, double dx, dd_real y, int n,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+
+/* Sign-magnitude fixed point on GMP limbs, least significant first: the
+ * value is sign * m * 2^(-GMP_NUMB_BITS*(limbs-1)), so m[limbs-1] holds the
+ * integral part. With the limb count fixed per frame the escape-time loop
+ * runs straight on the mpn_* primitives, skipping MPFR's exponent and
+ * rounding handling and never allocating. */
+#define MPN_MAX_LIMBS 8
+
+struct mpn_fixed {
+    int sign;  /* -1, 0 or +1; 0 exactly when m is zero */
+    mp_limb_t m[MPN_MAX_LIMBS];
+};
+
+/* Limbs needed for coordinates of `precision` bits, or 0 if that's more
+ * than MPN_MAX_LIMBS */
+int mpn_fixed_limbs(long precision);
+void mpn_fixed_from_mpfr(struct mpn_fixed *z, mpfr_t x, int limbs);
+/* z = a + k*b */
+void mpn_fixed_add_mul(struct mpn_fixed *z, const struct mpn_fixed *a,
+        const struct mpn_fixed *b, unsigned long k, int limbs);
+/* As escape_row(), with pixel i at (x0 + i*dx) + y*I. z isn't kept, so
+ * orbits stopped by max_iter are left at ORBIT_RESTART. */
+void escape_row_mpn(const struct mpn_fixed *x0, const struct mpn_fixed *dx,
+        const struct mpn_fixed *y, int limbs, int n, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits,
+        struct escape_stats *stats);
+
+/* Pick the widest kernels the running CPU supports. Call once at startup,
+ * before any worker thread uses escape_row or escape_row_dd. */
+void escape_kernel_init(void);
+const char *escape_kernel_name(void);
+
+#endif
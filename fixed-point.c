@@ -5,6 +5,10 @@
 void setIntK(fpreal_t z, uint32_t k)
 {
     z->m[0] = k;
+    if (z->sign == 0)
+        z->sign = 1;
+    if (isZeroN(FP_WIDTH_WORDS, z))
+        z->sign = 0;
 }
 
 void zeroN(int N, fpreal_t z)
@@ -19,18 +23,59 @@ void copyN(int N, fpreal_t z, fpreal_t x)
     memcpy(z->m, x->m, sizeof(x->m[0])*N);
 }
 
+/* Magnitude helpers: z = x + y returning the carry, z = x - y for x >= y */
+static uint32_t magAdd(int N, uint32_t *z, const uint32_t *x,
+        const uint32_t *y)
+{
+    uint64_t carry = 0;
+    for (int i = N-1; i >= 0; i--) {
+        carry += (uint64_t) x[i] + y[i];
+        z[i] = carry & 0xFFFFFFFF;
+        carry >>= 32;
+    }
+    return carry;
+}
+
+static void magSub(int N, uint32_t *z, const uint32_t *x, const uint32_t *y)
+{
+    uint64_t borrow = 0;
+    for (int i = N-1; i >= 0; i--) {
+        uint64_t d = (uint64_t) x[i] - y[i] - borrow;
+        z[i] = d & 0xFFFFFFFF;
+        borrow = d >> 63;
+    }
+}
+
+static int magCmp(int N, const uint32_t *x, const uint32_t *y)
+{
+    for (int i = 0; i < N; i++) {
+        if (x[i] < y[i])
+            return -1;
+        if (x[i] > y[i])
+            return 1;
+    }
+    return 0;
+}
+
 void addN(int N, fpreal_t z, fpreal_t x, uint64_t *in)
 {
-    // TODO: is the sign handled correctly here?
+    uint64_t carry = 0;
+    if (x->sign == 0) {
+        /* z is unchanged */
+    } else if (z->sign == 0) {
+        copyN(N, z, x);
+    } else if (z->sign == x->sign) {
+        carry = magAdd(N, z->m, z->m, x->m);
+    } else if (magCmp(N, z->m, x->m) >= 0) {
+        magSub(N, z->m, z->m, x->m);
+        if (isZeroN(N, z))
+            z->sign = 0;
+    } else {
+        magSub(N, z->m, x->m, z->m);
+        z->sign = x->sign;
+    }
     if (in != NULL)
-        for (int i = N-1; i >= 0; i--) {
-            *in = z->sign * z->m[i] + x->sign * x->m[i] + *in;
-            z->m[i] = *in & 0xFFFFFFFF;
-            *in >>= 32;
-        }
-    else
-        for (int i = N-1; i >= 0; i--)
-            z->m[i] += x->m[i];
+        *in = carry;
 }
 
 void subN(int N, fpreal_t z, fpreal_t x, uint64_t *in)
@@ -43,18 +88,113 @@ void subN(int N, fpreal_t z, fpreal_t x, uint64_t *in)
 
 void mulK(int N, fpreal_t z, uint32_t k, uint64_t *in)
 {
+    uint64_t carry = 0;
+    for (int i = N-1; i >= 0; i--) {
+        carry += (uint64_t) z->m[i] * k;
+        z->m[i] = carry & 0xFFFFFFFF;
+        carry >>= 32;
+    }
+    if (isZeroN(N, z))
+        z->sign = 0;
+    if (in != NULL)
+        *in = carry;
 }
 
 void divK(int N, fpreal_t z, uint32_t k, uint64_t *in)
 {
+    uint64_t rem = 0;
+    for (int i = 0; i < N; i++) {
+        rem = rem << 32 | z->m[i];
+        z->m[i] = rem / k;
+        rem %= k;
+    }
+    if (isZeroN(N, z))
+        z->sign = 0;
+    if (in != NULL)
+        *in = rem;
 }
 
 void shlK(int N, fpreal_t z, uint8_t k, uint32_t in)
 {
+    if (k == 0)
+        return;
+    for (int i = 0; i < N-1; i++)
+        z->m[i] = z->m[i] << k | z->m[i+1] >> (32 - k);
+    z->m[N-1] = z->m[N-1] << k | in >> (32 - k);
+    if (isZeroN(N, z))
+        z->sign = 0;
 }
 
 void shrK(int N, fpreal_t z, uint8_t k, uint32_t in)
 {
+    if (k == 0)
+        return;
+    for (int i = N-1; i > 0; i--)
+        z->m[i] = z->m[i] >> k | z->m[i-1] << (32 - k);
+    z->m[0] = z->m[0] >> k | in << (32 - k);
+    if (isZeroN(N, z))
+        z->sign = 0;
+}
+
+/* Keep the words of a 2N-word product p that line up with z's: p[0] is the
+ * top half of the integral part, which only a value >= 2^32 would need. */
+static void setProduct(int N, fpreal_t z, const uint32_t *p, int sign)
+{
+    memcpy(z->m, p + 1, sizeof(z->m[0])*N);
+    z->sign = sign;
+    if (isZeroN(N, z))
+        z->sign = 0;
+}
+
+void mulN(int N, fpreal_t z, fpreal_t x, fpreal_t y)
+{
+    uint32_t p[2*FP_WIDTH_WORDS];
+    memset(p, 0, sizeof(p[0])*2*N);
+    for (int i = N-1; i >= 0; i--) {
+        uint64_t carry = 0;
+        for (int j = N-1; j >= 0; j--) {
+            carry += (uint64_t) x->m[i] * y->m[j] + p[i+j+1];
+            p[i+j+1] = carry & 0xFFFFFFFF;
+            carry >>= 32;
+        }
+        p[i] = carry;
+    }
+    setProduct(N, z, p, x->sign * y->sign);
+}
+
+void sqrN(int N, fpreal_t z, fpreal_t x)
+{
+    uint32_t p[2*FP_WIDTH_WORDS];
+    uint64_t carry;
+    memset(p, 0, sizeof(p[0])*2*N);
+    /* The cross products x[i]*x[j], i < j, each appear twice */
+    for (int i = N-2; i >= 0; i--) {
+        carry = 0;
+        for (int j = N-1; j > i; j--) {
+            carry += (uint64_t) x->m[i] * x->m[j] + p[i+j+1];
+            p[i+j+1] = carry & 0xFFFFFFFF;
+            carry >>= 32;
+        }
+        p[2*i+1] = carry;
+    }
+    carry = 0;
+    for (int k = 2*N-1; k >= 0; k--) {
+        carry += (uint64_t) p[k] << 1;
+        p[k] = carry & 0xFFFFFFFF;
+        carry >>= 32;
+    }
+    /* Then add the squares x[i]^2 on the diagonal */
+    carry = 0;
+    for (int i = N-1; i >= 0; i--) {
+        uint64_t sq = (uint64_t) x->m[i] * x->m[i];
+        carry += (uint64_t) p[2*i+1] + (sq & 0xFFFFFFFF);
+        p[2*i+1] = carry & 0xFFFFFFFF;
+        carry >>= 32;
+        carry += (uint64_t) p[2*i] + (sq >> 32);
+        p[2*i] = carry & 0xFFFFFFFF;
+        carry >>= 32;
+    }
+    setProduct(N, z, p, x->sign != 0);
 }
 
 int cmpN(int N, fpreal_t x, fpreal_t y)
@@ -63,13 +203,8 @@ int cmpN(int N, fpreal_t x, fpreal_t y)
         return -1;
     if (x->sign > y->sign)
         return 1;
-    for (int i = N-1; i >= 0; i--) {
-        if (x->m[i] < y->m[i])
-            return -1;
-        if (x->m[i] > y->m[i])
-            return 1;
-    }
-    return 0;
+    /* Same sign: compare magnitudes, reversed for negative numbers */
+    return x->sign * magCmp(N, x->m, y->m);
 }
 
 bool isZeroN(int N, fpreal_t x)
@@ -82,10 +217,70 @@ bool isZeroN(int N, fpreal_t x)
 
 int msbN(int N, fpreal_t x)
 {
-    for (int i = N-1; i >= 0; i--) {
+    for (int i = 0; i < N; i++) {
         if (x->m[i] != 0)
-            return 31 - __builtin_clz(x->m[i]);
+            return 31 - __builtin_clz(x->m[i]) - 32*i;
     }
-    return 0;
+    return -32*N;
+}
+
+/* Truncates bits below the last word */
+void setMpfrN(int N, fpreal_t z, mpfr_t x)
+{
+    mpfr_t rest;
+    mpfr_init2(rest, mpfr_get_prec(x));
+    mpfr_abs(rest, x, MPFR_RNDN);
+    for (int i = 0; i < N; i++) {
+        z->m[i] = mpfr_get_ui(rest, MPFR_RNDZ);
+        mpfr_sub_ui(rest, rest, z->m[i], MPFR_RNDN);
+        mpfr_mul_2ui(rest, rest, 32, MPFR_RNDN);
+    }
+    mpfr_clear(rest);
+    z->sign = mpfr_sgn(x) > 0 ? 1 : mpfr_sgn(x) < 0 ? -1 : 0;
+    if (isZeroN(N, z))
+        z->sign = 0;
 }
 
+double getDoubleN(int N, fpreal_t x)
+{
+    double d = 0;
+    for (int i = N-1; i >= 0; i--)
+        d = d / 4294967296.0 + x->m[i];
+    return x->sign * d;
+}
+
+void escape_row_fixed(fpreal_t x0, fpreal_t dx, fpreal_t y, int n,
+        int max_iter, int *iters)
+{
+    const int N = FP_WIDTH_WORDS;
+    struct FPReal x, z_real, z_imag, z_real_2, z_imag_2, abs_2;
+    copyN(N, &x, x0);
+    for (int i = 0; i < n; i++) {
+        int it = 0;
+        copyN(N, &z_real, &x);
+        copyN(N, &z_imag, y);
+        sqrN(N, &z_real_2, &z_real);
+        sqrN(N, &z_imag_2, &z_imag);
+        while (true) {
+            /* |z|^2 < 4: both squares are positive, so a carry means >= 4 */
+            uint64_t carry;
+            copyN(N, &abs_2, &z_real_2);
+            addN(N, &abs_2, &z_imag_2, &carry);
+            if (carry != 0 || abs_2.m[0] >= 4 || it >= max_iter)
+                break;
+            it++;
+            /* z_imag = 2*z_real*z_imag + y */
+            mulN(N, &z_imag, &z_real, &z_imag);
+            shlK(N, &z_imag, 1, 0);
+            addN(N, &z_imag, y, NULL);
+            /* z_real = z_real^2 - z_imag^2 + x */
+            copyN(N, &z_real, &z_real_2);
+            subN(N, &z_real, &z_imag_2, NULL);
+            addN(N, &z_real, &x, NULL);
+            sqrN(N, &z_real_2, &z_real);
+            sqrN(N, &z_imag_2, &z_imag);
+        }
+        iters[i] = it;
+        addN(N, &x, dx, NULL);
+    }
+}
@@ -4,11 +4,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <mpfr.h>
 
-/* 4x32-bit words gives ~FP128 performance - 96-bits for the fractional part
+/* 4x32-bit words gives ~FP128 performance - 96-bits for the fractional part.
+ * Override at compile time (-DFP_WIDTH_WORDS=3) to trade depth for speed.
  */
+#ifndef FP_WIDTH_WORDS
 #define FP_WIDTH_WORDS 4
+#endif
 
+/* Sign-magnitude fixed point: m[0] is the integral part and m[1..N-1] the
+ * fraction, most significant word first. The sign is 0 exactly when the
+ * magnitude is zero. Functions taking N work on the first N words, for any
+ * N <= FP_WIDTH_WORDS. */
 struct FPReal {
     int sign; // -1, 0, +1
     uint32_t m[FP_WIDTH_WORDS];
@@ -19,14 +27,29 @@ typedef struct FPReal * fpreal_t;
 void setIntK(fpreal_t z, uint32_t k); /* Set the integral part of Z */
 void zeroN(int N, fpreal_t z);
 void copyN(int N, fpreal_t z, fpreal_t x);
+/* The carry out of the integral word (an overflow) is returned in *in */
 void addN(int N, fpreal_t z, fpreal_t x, uint64_t *in);
 void subN(int N, fpreal_t z, fpreal_t x, uint64_t *in);
+/* The carry out of the integral word is returned in *in */
 void mulK(int N, fpreal_t z, uint32_t k, uint64_t *in);
+/* The remainder is returned in *in */
 void divK(int N, fpreal_t z, uint32_t k, uint64_t *in);
+/* `in` is the word beyond the end the bits are shifted in from */
 void shlK(int N, fpreal_t z, uint8_t k, uint32_t in); /* k is 0..31 */
 void shrK(int N, fpreal_t z, uint8_t k, uint32_t in); /* k is 0..31 */
+/* z = x*y and z = x^2, truncated. z may be the same as x or y. */
+void mulN(int N, fpreal_t z, fpreal_t x, fpreal_t y);
+void sqrN(int N, fpreal_t z, fpreal_t x);
 int cmpN(int N, fpreal_t x, fpreal_t y);
 bool isZeroN(int N, fpreal_t x);
+/* x is in [2^msb, 2^(msb+1)), msb being negative for bits of the fraction */
 int msbN(int N, fpreal_t x);
+void setMpfrN(int N, fpreal_t z, mpfr_t x);
+double getDoubleN(int N, fpreal_t x);
+
+/* Escape-time counts of `n` pixels along a row in FP_WIDTH_WORDS-word fixed
+ * point: pixel i is at (x0 + i*dx) + y*I. Counts match escape_row(). */
+void escape_row_fixed(fpreal_t x0, fpreal_t dx, fpreal_t y, int n,
+        int max_iter, int *iters);
 
 #endif
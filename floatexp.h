@@ -0,0 +1,121 @@
+#ifndef __FLOATEXP_H
+#define __FLOATEXP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <mpfr.h>
+
+/* A double mantissa with a separate 64-bit exponent: value = m * 2^e.
+ *
+ * Doubles underflow past ~1e-308, long before a deep zoom runs out of
+ * interesting detail, while MPFR pays for a function call and rounding-mode
+ * handling on every operation. A floatexp keeps the 53-bit mantissa and
+ * arithmetic cost of a double but can't underflow.
+ *
+ * Values are kept normalised, 0.5 <= |m| < 1, except zero which is stored
+ * with a hugely negative exponent so it always loses exponent alignment in
+ * fe_add(). The operations only use integer bit manipulation and plain
+ * double arithmetic (no frexp/ldexp), so loops over arrays of them can be
+ * vectorised by the compiler. */
+typedef struct {
+    double m;
+    int64_t e;
+} floatexp;
+
+#define FE_ZERO_EXP (INT64_MIN / 4)
+#define FE_MANTISSA_BITS 53
+
+static inline uint64_t fe_bits(double d)
+{ uint64_t u; memcpy(&u, &d, sizeof(u)); return u; }
+
+static inline double fe_double(uint64_t u)
+{ double d; memcpy(&d, &u, sizeof(d)); return d; }
+
+/* Renormalise m * 2^e where m is a normal double (or zero) */
+static inline floatexp fe_normalize(double m, int64_t e)
+{
+    uint64_t bits = fe_bits(m);
+    int64_t biased = (bits >> 52) & 0x7FF;
+    floatexp r;
+    /* Swap m's exponent for 2^-1, moving the difference into e */
+    r.m = fe_double((bits & ~(0x7FFULL << 52)) | (1022ULL << 52));
+    r.e = e + biased - 1022;
+    if (biased == 0) {
+        r.m = 0;
+        r.e = FE_ZERO_EXP;
+    }
+    return r;
+}
+
+/* 2^k as a double, for -1022 <= k <= 1023 */
+static inline double fe_pow2(int64_t k)
+{ return fe_double((uint64_t)(k + 1023) << 52); }
+
+static inline floatexp fe_from_d(double d)
+{
+    int e;
+    double m = frexp(d, &e);
+    return m == 0 ? (floatexp) {0, FE_ZERO_EXP} : (floatexp) {m, e};
+}
+
+static inline double fe_to_d(floatexp a)
+{
+    /* Clamp so ldexp's int exponent can't wrap; it under/overflows anyway */
+    int64_t e = a.e < -2000 ? -2000 : a.e > 2000 ? 2000 : a.e;
+    return ldexp(a.m, (int) e);
+}
+
+static inline floatexp fe_from_mpfr(mpfr_t x)
+{
+    long e;
+    double m;
+    if (mpfr_zero_p(x))
+        return (floatexp) {0, FE_ZERO_EXP};
+    m = mpfr_get_d_2exp(&e, x, MPFR_RNDN);
+    return fe_normalize(m, e);
+}
+
+static inline floatexp fe_neg(floatexp a)
+{ a.m = -a.m; return a; }
+
+static inline floatexp fe_ldexp(floatexp a, int64_t k)
+{ a.e += k; return a; }
+
+static inline floatexp fe_mul(floatexp a, floatexp b)
+{ return fe_normalize(a.m * b.m, a.e + b.e); }
+
+static inline floatexp fe_mul_d(floatexp a, double d)
+{ return fe_mul(a, fe_from_d(d)); }
+
+static inline floatexp fe_add(floatexp a, floatexp b)
+{
+    floatexp big = a.e >= b.e ? a : b;
+    floatexp small = a.e >= b.e ? b : a;
+    int64_t shift = big.e - small.e;
+    /* Anything more than a mantissa below the larger operand vanishes */
+    double scaled = shift > FE_MANTISSA_BITS + 1 ? 0 : small.m * fe_pow2(-shift);
+    return fe_normalize(big.m + scaled, big.e);
+}
+
+static inline floatexp fe_sub(floatexp a, floatexp b)
+{ return fe_add(a, fe_neg(b)); }
+
+/* sqrt(a^2 + b^2) */
+static inline floatexp fe_hypot(floatexp a, floatexp b)
+{
+    int64_t e = a.e >= b.e ? a.e : b.e;
+    int64_t sa = e - a.e, sb = e - b.e;
+    double ma = sa > FE_MANTISSA_BITS + 1 ? 0 : a.m * fe_pow2(-sa);
+    double mb = sb > FE_MANTISSA_BITS + 1 ? 0 : b.m * fe_pow2(-sb);
+    return fe_normalize(sqrt(ma * ma + mb * mb), e);
+}
+
+/* -1, 0 or 1 as a < b, a == b, a > b */
+static inline int fe_cmp(floatexp a, floatexp b)
+{
+    double d = fe_sub(a, b).m;
+    return (d > 0) - (d < 0);
+}
+
+#endif
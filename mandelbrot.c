@@ -6,16 +6,20 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
-#include <immintrin.h> // TODO
 #include <mpfr.h>
+#include <stdatomic.h>
 
 #include "png_maker.h"
 #include "tpool.h"
 #include "sdl_window.h"
+#include "escape_kernel.h"
+#include "perturbation.h"
+#include "fixed-point.h"
+#include "palette.h"
+#include "cpu_placement.h"
 
 
 #define MAX_ITER 128
-#define MY_INFINITY 4
 #define IMG_WIDTH 1920
 #define IMG_HEIGHT 1080
 #define X_MIN -2.6
@@ -23,89 +27,282 @@
 
 #define HUE_OFFSET 0
 
+/* Boundary tracing starts from tiles of up to TRACE_TILE_W x TRACE_TILE_H
+ * and computes tiles smaller than TRACE_MIN_SIZE either way in full. With
+ * TRACE_SPOT_CHECK set, a uniform border is only trusted if the tile's
+ * centre pixel agrees with it. */
+#define TRACE_TILE_W 256
+#define TRACE_TILE_H 144
+#define TRACE_MIN_SIZE 8
+#define TRACE_SPOT_CHECK 1
+
+/* Progressive rendering first computes every PROGRESSIVE_STEP'th pixel of
+ * every PROGRESSIVE_STEP'th row, then halves the step each pass. */
+#define PROGRESSIVE_STEP 4
+
+/* Tiles are split until their estimated cost is below the pass's total over
+ * TILES_PER_WORKER tiles per worker, down to TILE_MIN_W x TILE_MIN_H pixels,
+ * and are never larger than TILE_MAX_W x TILE_MAX_H. Both scale with the
+ * step of a coarse pass. A pixel is reckoned to cost TILE_PIXEL_COST
+ * iterations' worth on top of its own, and an interior one INTERIOR_COST
+ * iterations, as periodicity checking stops most of them well short of
+ * max_iter. */
+#define TILES_PER_WORKER 16
+#define TILE_MIN_W 16
+#define TILE_MIN_H 9
+#define TILE_MAX_W 64
+#define TILE_MAX_H 36
+#define TILE_PIXEL_COST 8
+#define INTERIOR_COST 64
+
+/* The window is presented at most MAX_FPS times a second by default */
+#define MAX_FPS 60
+
+/* `mandelbrot --output` compresses at zlib level PNG_LEVEL and filters
+ * rows with PNG_FILTER by default, as libpng would */
+#define PNG_LEVEL 6
+#define PNG_FILTER ROW_FILTER_ADAPTIVE
+
+/* `mandelbrot --bench-workers` renders BENCH_FRAMES frames of
+ * BENCH_MAX_ITER iterations in the seahorse valley under each placement */
+#define BENCH_FRAMES 7
+#define BENCH_MAX_ITER 2048
+
+/* `mandelbrot --bench-pool` also times BENCH_POOL_TASKS tasks of
+ * BENCH_POOL_WORK LCG steps each, BENCH_FRAMES times per worker count */
+#define BENCH_POOL_TASKS 20000
+#define BENCH_POOL_WORK 50
+
 /* TODO:
- * * Fixed-point numbers - could they be faster than MPFR fixed-width floating
- * point?
+ * * Fixed-point numbers are ~4-5x faster than MPFR but ~10x slower than
+ *   double-double over the same depths (`mandelbrot --bench`), so they aren't
+ *   used for the window.
  * * Would OpenCL be faster for computing the mandelbrot iterations?
  *      * OpenCL C mixed-precision (MPFR)?
- * * When zooming, use SDL_BlitScaled
- * * Don't re-render areas which already have been determined to terminate (when changing the max iterations)
- * * Write rendering function using AVX2 256-bit SIMD compiler intrinsics (immintrin.h)
  */
 
-void render_rect(double x, double y, double w, double h, SDL_Surface *img,
-        SDL_Rect view, int max_iter)
+/* Colour the pixels in `view` of the surface from the window's iteration
+ * buffer, whose rows are `stride` pixels apart */
+static void colour_rect(SDL_Surface *img, SDL_Rect view, const int *iters,
+        const float *escaped_abs_2, int stride,
+        const struct palette *palette, bool smooth)
 {
-    double scale_x = w / (double)view.w;
-    double scale_y = h / (double)view.h;
-    double x_cur, y_cur = y;
-    double z_real, z_imag;
-    int it;
-    for (int py = view.y; py < view.y + view.h; py++) {
-        x_cur = x;
-        for (int px = view.x; px < view.x + view.w; px++) {
-            it = 0;  /* Iterations counter */
-            z_real = x_cur;
-            z_imag = y_cur;
-            while (pow(z_real, 2) + pow(z_imag, 2) < MY_INFINITY && it < max_iter) {
-                it++;
-                /* z = cpow(z, 2) + c
-                 * z = (a + bI)(a + bI) + (d + eI)
-                 * z = a^2 + 2*a*bI - b^2 + d + eI
-                 * z_real = a^2 - b^2 + d
-                 * z_imag = 2*a*b + e
-                 * z_real = z_real^2 - z_imag^2 + x
-                 * z_imag = 2*z_real*z_imag + y
-                 */
-                double a = pow(z_real, 2) - pow(z_imag, 2) + x_cur;
-                double b = 2 * z_real * z_imag + y_cur;
-                z_real = a;
-                z_imag = b;
-            }
-            // normalize between 0 and 360 for hue.
-            double hue = 360 * (double) it / (double) max_iter;
-            struct HSV hsv = {hue, 1.0, 1.0};
-            struct RGB rgb = HSVToRGB(hsv);
-
-            uint8_t red = rgb.R;
-            uint8_t green = rgb.G;
-            uint8_t blue = rgb.B;
-            if (it == max_iter) {
-                red = green = blue = 0;
-            }
-            uint32_t pixel = red << 16 | green << 8 | blue;
-            uint32_t *target_pixel = (uint32_t*) ((uint8_t*) img->pixels + py*img->pitch + px*img->format->BytesPerPixel);
-            *target_pixel = pixel;
-            x_cur += scale_x;
-        }
-        y_cur += scale_y;
+    for (int row = 0; row < view.h; row++) {
+        uint32_t *target_row = (uint32_t*) ((uint8_t*) img->pixels + (view.y+row)*img->pitch + view.x*img->format->BytesPerPixel);
+        int offset = (view.y + row)*stride + view.x;
+        palette_colour_row(palette, iters + offset, escaped_abs_2 + offset,
+                smooth, view.w, target_row);
+    }
+}
+
+/* The render_rect*() functions take the pixel grid of the whole surface:
+ * pixel (px, py) is at (x + px*dx) + (y + py*dy)*I. They compute the
+ * iteration counts of the pixels in `view` into `iters`, and |z|^2 at escape
+ * into escaped_abs_2 if it isn't NULL. iters[0] is the count of pixel
+ * (view.x, view.y) and rows are `stride` counts apart. If orbits isn't NULL
+ * it is laid out the same way, and pixels carry on from it as in
+ * escape_row(). */
+void render_rect(double x, double y, double dx, double dy, SDL_Rect view,
+        int max_iter, int *iters, float *escaped_abs_2, struct orbit *orbits,
+        int stride, struct escape_stats *stats)
+{
+    for (int row = 0; row < view.h; row++) {
+        int py = view.y + row;
+        escape_row(x + view.x * dx, dx, y + py * dy, view.w, max_iter,
+                iters + row*stride, escaped_abs_2 == NULL ? NULL
+                : escaped_abs_2 + row*stride, orbits == NULL ? NULL
+                : orbits + row*stride, stats);
+    }
+}
+
+void render_rect_double_double(dd_real x, dd_real y, double dx, double dy,
+        SDL_Rect view, int max_iter, int *iters, float *escaped_abs_2,
+        struct orbit *orbits, int stride, struct escape_stats *stats)
+{
+    dd_real x0 = dd_add_d(x, view.x * dx);
+    for (int row = 0; row < view.h; row++) {
+        int py = view.y + row;
+        escape_row_dd(x0, dx, dd_add_d(y, py * dy), view.w, max_iter,
+                iters + row*stride, escaped_abs_2 == NULL ? NULL
+                : escaped_abs_2 + row*stride, orbits == NULL ? NULL
+                : orbits + row*stride, stats);
     }
 }
 
-void render_rect_high_precision(mpfr_t x, mpfr_t y, mpfr_t w, mpfr_t h,
-        SDL_Surface *img, SDL_Rect view, int max_iter, long precision)
+void render_rect_fixed(fpreal_t x, fpreal_t y, fpreal_t dx, fpreal_t dy,
+        SDL_Rect view, int max_iter, int *iters, int stride)
 {
-    mpfr_t scale_x, scale_y;
-    mpfr_t x_cur, y_cur;
+    const int N = FP_WIDTH_WORDS;
+    struct FPReal x0, y_cur, step;
+    /* x0 = x + view.x*dx; y_cur = y + view.y*dy; */
+    copyN(N, &x0, dx);
+    mulK(N, &x0, view.x, NULL);
+    addN(N, &x0, x, NULL);
+    copyN(N, &y_cur, dy);
+    mulK(N, &y_cur, view.y, NULL);
+    addN(N, &y_cur, y, NULL);
+    for (int row = 0; row < view.h; row++) {
+        escape_row_fixed(&x0, dx, &y_cur, view.w, max_iter,
+                iters + row*stride);
+        copyN(N, &step, dy);
+        addN(N, &y_cur, &step, NULL);
+    }
+}
+
+/* Temporaries of the per-pixel MPFR path. Each worker allocates its own
+ * once, in worker_spin(), instead of every tile initialising and clearing
+ * nine MPFR values. */
+struct hp_scratch {
+    mpfr_t x_start, x_cur, y_cur;
     mpfr_t z_real, z_imag, mpfr_tmp1, mpfr_tmp2, z_abs_2;
-    int it;
+    mpfr_t saved_real, saved_imag, eps;  /* Periodicity checking */
+    mpfr_t dx_step, dy_step;  /* The pixel spacing of a coarse pass */
+};
 
-    // TODO: determine if there are any black pixels in the region described by `view`
-    mpfr_inits2(precision, scale_x, scale_y, x_cur, y_cur, z_real,
-            z_imag, mpfr_tmp1, mpfr_tmp2, z_abs_2, NULL);
+static __thread struct hp_scratch *hp_scratch;
+
+void hp_scratch_init(struct hp_scratch *s)
+{
+    mpfr_inits2(MPFR_PREC_MIN, s->x_start, s->x_cur, s->y_cur, s->z_real,
+            s->z_imag, s->mpfr_tmp1, s->mpfr_tmp2, s->z_abs_2, s->saved_real,
+            s->saved_imag, s->eps, s->dx_step, s->dy_step, NULL);
+    hp_scratch = s;
+}
+
+void hp_scratch_clear(struct hp_scratch *s)
+{
+    mpfr_clears(s->x_start, s->x_cur, s->y_cur, s->z_real, s->z_imag,
+            s->mpfr_tmp1, s->mpfr_tmp2, s->z_abs_2, s->saved_real,
+            s->saved_imag, s->eps, s->dx_step, s->dy_step, NULL);
+    hp_scratch = NULL;
+}
+
+/* Buffers each worker keeps for coarse passes and cost maps, only ever
+ * grown, so that tiles don't allocate their own */
+struct worker_scratch {
+    int *iters;
+    float *abs_2;
+    struct orbit *orbits;
+    uint32_t *colours, *line;
+    long *cost_sums;
+    long grid_size, line_size, sums_size;
+};
+
+static __thread struct worker_scratch worker_scratch;
+
+/* Make room for a grid of n pixels and lines of w */
+static void worker_scratch_reserve(struct worker_scratch *s, long n, long w)
+{
+    if (n > s->grid_size) {
+        free(s->iters);
+        free(s->abs_2);
+        free(s->orbits);
+        s->iters = malloc(sizeof(int) * n);
+        s->abs_2 = malloc(sizeof(float) * n);
+        s->orbits = malloc(sizeof(struct orbit) * n);
+        s->grid_size = n;
+    }
+    if (w > s->line_size) {
+        free(s->colours);
+        free(s->line);
+        s->colours = malloc(sizeof(uint32_t) * w);
+        s->line = malloc(sizeof(uint32_t) * w);
+        s->line_size = w;
+    }
+}
+
+void worker_scratch_clear(struct worker_scratch *s)
+{
+    free(s->iters);
+    free(s->abs_2);
+    free(s->orbits);
+    free(s->colours);
+    free(s->line);
+    free(s->cost_sums);
+    memset(s, 0, sizeof(struct worker_scratch));
+}
+
+/* Whether c = x + y*I is inside the main cardioid or the period-2 bulb,
+ * using the scratch values as temporaries */
+static bool hp_in_cardioid_or_bulb(mpfr_t x, mpfr_t y, struct hp_scratch *s)
+{
+    mpfr_ptr x_q = s->z_real, y_2 = s->z_imag;
+    mpfr_ptr q = s->mpfr_tmp1, t = s->mpfr_tmp2;
+    /* q = (x - 1/4)^2 + y^2; inside the cardioid if q*(q + x - 1/4) <= y^2/4 */
+    mpfr_sub_d(x_q, x, 0.25, MPFR_RNDN);
+    mpfr_sqr(y_2, y, MPFR_RNDN);
+    mpfr_sqr(q, x_q, MPFR_RNDN);
+    mpfr_add(q, q, y_2, MPFR_RNDN);
+    mpfr_add(t, q, x_q, MPFR_RNDN);
+    mpfr_mul(q, q, t, MPFR_RNDN);
+    mpfr_div_2ui(t, y_2, 2, MPFR_RNDN);
+    if (mpfr_cmp(q, t) <= 0)
+        return true;
+    /* Inside the bulb if (x + 1)^2 + y^2 <= 1/16 */
+    mpfr_add_ui(t, x, 1, MPFR_RNDN);
+    mpfr_sqr(t, t, MPFR_RNDN);
+    mpfr_add(t, t, y_2, MPFR_RNDN);
+    return mpfr_cmp_d(t, 0.0625) <= 0;
+}
 
-    /* double scale_x = w / (double)view.w; */
-    /* double scale_y = h / (double)view.h; */
-    mpfr_div_d(scale_x, w, view.w, MPFR_RNDU);
-    mpfr_div_d(scale_y, h, view.h, MPFR_RNDU);
+/* Nothing is kept of orbits stopped by max_iter; see escape_row_mpn() */
+void render_rect_high_precision(mpfr_t x, mpfr_t y, mpfr_t dx, mpfr_t dy,
+        SDL_Rect view, int max_iter, long precision, int *iters,
+        float *escaped_abs_2, struct orbit *orbits, int stride,
+        struct escape_stats *stats)
+{
+    struct hp_scratch *s = hp_scratch;
+    mpfr_ptr x_start = s->x_start, x_cur = s->x_cur, y_cur = s->y_cur;
+    mpfr_ptr z_real = s->z_real, z_imag = s->z_imag;
+    mpfr_ptr mpfr_tmp1 = s->mpfr_tmp1, mpfr_tmp2 = s->mpfr_tmp2;
+    mpfr_ptr z_abs_2 = s->z_abs_2;
+    mpfr_ptr saved_real = s->saved_real, saved_imag = s->saved_imag;
+    int it, check;
+    bool interior;
 
-    /* y_cur = y; */
-    mpfr_set(y_cur, y, MPFR_RNDU);
+    // TODO: determine if there are any black pixels in the region described by `view`
+    /* Only reallocates when the view's precision has changed */
+    if (mpfr_get_prec(x_start) != precision) {
+        mpfr_set_prec(x_start, precision);
+        mpfr_set_prec(x_cur, precision);
+        mpfr_set_prec(y_cur, precision);
+        mpfr_set_prec(z_real, precision);
+        mpfr_set_prec(z_imag, precision);
+        mpfr_set_prec(mpfr_tmp1, precision);
+        mpfr_set_prec(mpfr_tmp2, precision);
+        mpfr_set_prec(z_abs_2, precision);
+        mpfr_set_prec(saved_real, precision);
+        mpfr_set_prec(saved_imag, precision);
+    }
+    /* Orbits within eps of an earlier point are periodic */
+    mpfr_set_prec(s->eps, mpfr_get_prec(dx));
+    mpfr_mul_d(s->eps, dx, PERIOD_TOLERANCE, MPFR_RNDN);
+
+    /* x_start = x + view.x * dx; */
+    mpfr_mul_si(x_start, dx, view.x, MPFR_RNDN);
+    mpfr_add(x_start, x_start, x, MPFR_RNDN);
+    /* y_cur = y + view.y * dy; */
+    mpfr_mul_si(y_cur, dy, view.y, MPFR_RNDN);
+    mpfr_add(y_cur, y_cur, y, MPFR_RNDN);
     for (int py = view.y; py < view.y + view.h; py++) {
-        /* x_cur = x; */
-        mpfr_set(x_cur, x, MPFR_RNDU);
+        /* x_cur = x_start; */
+        mpfr_set(x_cur, x_start, MPFR_RNDU);
         for (int px = view.x; px < view.x + view.w; px++) {
+            int pixel = (py - view.y)*stride + px - view.x;
+            if (orbits != NULL && !orbit_pending(orbits + pixel,
+                        iters + pixel, max_iter)) {
+                /* x_cur += dx; */
+                mpfr_add(x_cur, x_cur, dx, MPFR_RNDU);
+                continue;
+            }
             it = 0;  /* Iterations counter */
+            check = 1;  /* Next iteration to save z at */
+            /* Points in the cardioid or bulb skip the loop below */
+            interior = hp_in_cardioid_or_bulb(x_cur, y_cur, s);
+            if (interior) {
+                it = max_iter;
+                stats->in_bulb++;
+            }
             /* z_real = x_cur; */
             mpfr_set(z_real, x_cur, MPFR_RNDU);
             /* z_imag = y_cur; */
@@ -115,6 +312,22 @@ void render_rect_high_precision(mpfr_t x, mpfr_t y, mpfr_t w, mpfr_t h,
             mpfr_sqr(mpfr_tmp2, z_imag, MPFR_RNDU); /* pow(z_imag, 2) */
             mpfr_add(z_abs_2, mpfr_tmp1, mpfr_tmp2, MPFR_RNDU); /* pow(z_real, 2) + pow(z_imag, 2) */
             while (mpfr_cmp_ui(z_abs_2, MY_INFINITY) <= 0 && it < max_iter) {
+                /* Brent: compare against z saved at power-of-two iterations */
+                if (it == check) {
+                    mpfr_set(saved_real, z_real, MPFR_RNDN);
+                    mpfr_set(saved_imag, z_imag, MPFR_RNDN);
+                    check *= 2;
+                } else if (it > 1) {
+                    mpfr_sub(mpfr_tmp1, z_real, saved_real, MPFR_RNDN);
+                    mpfr_sub(mpfr_tmp2, z_imag, saved_imag, MPFR_RNDN);
+                    if (mpfr_cmpabs(mpfr_tmp1, s->eps) < 0
+                            && mpfr_cmpabs(mpfr_tmp2, s->eps) < 0) {
+                        it = max_iter;
+                        interior = true;
+                        stats->periodic++;
+                        break;
+                    }
+                }
                 it++;
                 /* z = cpow(z, 2) + c
                  * z = (a + bI)(a + bI) + (d + eI)
@@ -143,56 +356,74 @@ void render_rect_high_precision(mpfr_t x, mpfr_t y, mpfr_t w, mpfr_t h,
                 mpfr_sqr(mpfr_tmp2, z_imag, MPFR_RNDU); /* pow(z_imag, 2) */
                 mpfr_add(z_abs_2, mpfr_tmp1, mpfr_tmp2, MPFR_RNDU); /* pow(z_real, 2) + pow(z_imag, 2) */
             }
-            // normalize between 0 and 360 for hue.
-            double hue = 360 * (double) it / (double) max_iter;
-            struct HSV hsv = {hue, 1.0, 1.0};
-            struct RGB rgb = HSVToRGB(hsv);
-
-            uint8_t red = rgb.R;
-            uint8_t green = rgb.G;
-            uint8_t blue = rgb.B;
-            if (it == max_iter) {
-                red = green = blue = 0;
-            }
-            uint32_t pixel = red << 16 | green << 8 | blue;
-            uint32_t *target_pixel = (uint32_t*) ((uint8_t*) img->pixels + py*img->pitch + px*img->format->BytesPerPixel);
-            *target_pixel = pixel;
-            /* x_cur += scale_x; */
-            mpfr_add(x_cur, x_cur, scale_x, MPFR_RNDU);
+            iters[pixel] = it;
+            if (escaped_abs_2 != NULL && it < max_iter)
+                escaped_abs_2[pixel] = mpfr_get_d(z_abs_2, MPFR_RNDN);
+            if (orbits != NULL)
+                orbits[pixel].m = orbit_ended(it, max_iter, interior);
+            /* x_cur += dx; */
+            mpfr_add(x_cur, x_cur, dx, MPFR_RNDU);
         }
-        /* y_cur += scale_y; */
-        mpfr_add(y_cur, y_cur, scale_y, MPFR_RNDU);
+        /* y_cur += dy; */
+        mpfr_add(y_cur, y_cur, dy, MPFR_RNDU);
     }
-    mpfr_clears(x, y, w, h, scale_x, scale_y, x_cur, y_cur, z_real, z_imag,
-            mpfr_tmp1, mpfr_tmp2, z_abs_2, NULL);
 }
 
-struct render_rect_args {
-    double x, y, w, h;
-    mpfr_t x_hp, y_hp, w_hp, h_hp;
-    SDL_Surface *img;
-    SDL_Rect view;
-    int max_iter;
-    bool use_high_precision;
-    long precision;
-};
+/* The same on fixed-limb numbers; see struct mpn_fixed */
+void render_rect_mpn(const struct mpn_fixed *x, const struct mpn_fixed *y,
+        const struct mpn_fixed *dx, const struct mpn_fixed *dy, int limbs,
+        SDL_Rect view, int max_iter, int *iters, float *escaped_abs_2,
+        struct orbit *orbits, int stride, struct escape_stats *stats)
+{
+    struct mpn_fixed x0, y_cur;
+    mpn_fixed_add_mul(&x0, x, dx, view.x, limbs);
+    for (int row = 0; row < view.h; row++) {
+        int py = view.y + row;
+        mpn_fixed_add_mul(&y_cur, y, dy, py, limbs);
+        escape_row_mpn(&x0, dx, &y_cur, limbs, view.w, max_iter,
+                iters + row*stride, escaped_abs_2 == NULL ? NULL
+                : escaped_abs_2 + row*stride, orbits == NULL ? NULL
+                : orbits + row*stride, stats);
+    }
+}
 
-void *worker_render_rect(void *arguments)
+/* Render a rectangle by perturbation against a reference orbit. The pixel
+ * grid, (x + px*dx) + (y + py*dy)*I, gives each pixel's offset from the
+ * reference point. */
+void render_rect_perturbation(struct reference_orbit *ref, floatexp x,
+        floatexp y, floatexp dx, floatexp dy, SDL_Rect view, int max_iter,
+        int *iters, float *escaped_abs_2, struct orbit *orbits, int stride,
+        struct escape_stats *stats)
 {
-    struct render_rect_args *args = arguments;
-    if (args->use_high_precision) {
-        render_rect_high_precision(args->x_hp, args->y_hp, args->w_hp,
-                args->h_hp, args->img, args->view, args->max_iter,
-                args->precision);
-    } else {
-        render_rect(args->x, args->y, args->w, args->h, args->img, args->view,
-                args->max_iter);
+    floatexp x_start = fe_add(x, fe_mul_d(dx, view.x));
+    floatexp y_start = fe_add(y, fe_mul_d(dy, view.y));
+    floatexp x_end = fe_add(x_start, fe_mul_d(dx, view.w));
+    floatexp y_end = fe_add(y_start, fe_mul_d(dy, view.h));
+    /* Every pixel of the tile lies within `radius` of the reference point */
+    floatexp radius = fe_hypot(x_start, y_start), corner;
+    corner = fe_hypot(x_end, y_start);
+    if (fe_cmp(corner, radius) > 0) radius = corner;
+    corner = fe_hypot(x_start, y_end);
+    if (fe_cmp(corner, radius) > 0) radius = corner;
+    corner = fe_hypot(x_end, y_end);
+    if (fe_cmp(corner, radius) > 0) radius = corner;
+    int skip = reference_orbit_skip(ref, radius, max_iter);
+    for (int row = 0; row < view.h; row++) {
+        int py = view.y + row;
+        perturb_row(ref, skip, x_start, dx, fe_add(y, fe_mul_d(dy, py)),
+                view.w, max_iter, iters + row*stride, escaped_abs_2 == NULL ? NULL
+                : escaped_abs_2 + row*stride, orbits == NULL ? NULL
+                : orbits + row*stride, stats);
     }
-    return NULL;
 }
 
-void *exit_thread(void *return_value)
-{ pthread_exit(return_value); }
+/* How a frame's pixels are computed, cheapest first */
+enum render_tier {
+    TIER_DOUBLE,
+    TIER_DOUBLE_DOUBLE,
+    TIER_PERTURBATION,
+    TIER_MPFR,
+};
 
 long nanos_diff(struct timespec start, struct timespec end)
 {
@@ -206,155 +437,1733 @@ long nanos_diff(struct timespec start, struct timespec end)
     return retval;
 }
 
-struct rendering_stats {
-    long nanos_rendering;
-    long nanos_waiting;
+/* Everything the tiles of one draw() share: the surface, the window's
+ * iteration buffer and its pixel grid, in the number format of the frame's
+ * tier. Only the grid of that tier is set. The frame is freed by whichever
+ * tile releases the last reference. */
+struct render_frame {
+    atomic_int refs;
+    enum render_tier tier;
+    SDL_Surface *img;
+    /* Pixel (px, py)'s count is iters[py*stride + px] */
+    int *iters;
+    float *escaped_abs_2;
+    struct orbit *orbits;
+    int stride;
+    int max_iter;
+    struct palette *palette;
+    bool smooth;  /* Smooth colouring */
+    bool colour_only;  /* Recolour the surface from the buffer */
+    bool resume;  /* Carry the buffer's orbits on instead of starting anew */
+    /* Pixel (px, py) is at (x + px*dx) + (y + py*dy)*I */
+    double x, y, dx, dy;
+    dd_real x_dd, y_dd;
+    mpfr_t x_hp, y_hp, dx_hp, dy_hp;
+    long precision;
+    /* TIER_MPFR also keeps the grid in fixed-limb form if it fits */
+    int limbs;
+    struct mpn_fixed x_mpn, y_mpn, dx_mpn, dy_mpn;
+    /* TIER_PERTURBATION keeps its grid with the reference orbit */
+    struct reference_orbit *ref;
+    /* Statistics, reported when the last tile is done */
+    struct timespec start;
+    atomic_long in_bulb, periodic;
+    atomic_long traced;  /* Pixels filled in by boundary tracing */
+    atomic_long mirrored;  /* Pixels copied from across the real axis */
+    /* Subdivide tiles by boundary tracing, queueing them on q */
+    bool boundary_trace;
+    struct queue *q;
+    void *(*render_func)(void*);
+    /* The current pass only computes pixels whose coordinates are both
+     * multiples of step, and paints each over the block it stands for. Those
+     * that are multiples of kept_step were computed by the pass before (none
+     * if 0). When the last of the pass's tiles is done the step is halved
+     * and `area` queued again, until a pass at step 1 finishes the frame. */
+    int step, kept_step;
+    SDL_Rect area;
+    atomic_int pass_tiles;  /* Tiles of the current pass not yet done */
+    /* The current pass's tiles, in the frame's tile order. Each task queued
+     * for them starts the next one, whichever it was queued with, so they
+     * start in order whichever end of a deque the tasks are taken from. The
+     * array is kept for the next frame when the frame is reused. */
+    enum tile_order tile_order;
+    struct render_rect_args **order;
+    int order_n, order_size;
+    atomic_int order_next;
+    /* The frame is stale once state->generation has moved on from this */
+    struct render_state *state;
+    int generation;
+    atomic_bool abandoned;  /* Some tile found the frame stale */
+    /* Rows mirror_y0..mirror_y1 of the drawn area are the complex conjugates
+     * of rows mirror_k - py. They aren't computed: tiles copy their own rows
+     * there instead. Empty when mirror_y0 > mirror_y1. */
+    int mirror_k, mirror_y0, mirror_y1;
+};
+
+/* The last frame freed, kept for the next to save allocating it */
+static _Atomic(struct render_frame *) spare_frame;
+
+void render_frame_retain(struct render_frame *frame)
+{ atomic_fetch_add(&frame->refs, 1); }
+
+void render_frame_release(struct render_frame *frame)
+{
+    struct timespec end;
+    struct render_state *state = frame->state;
+    if (atomic_fetch_sub(&frame->refs, 1) != 1)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (atomic_load(&frame->abandoned))
+        printf("[RENDER   ] Stale frame dropped after %.4lf seconds\n",
+                nanos_diff(frame->start, end)/(double)1000000000);
+    else if (frame->colour_only)
+        printf("[RENDER   ] Recoloured in %.4lf seconds\n",
+                nanos_diff(frame->start, end)/(double)1000000000);
+    else
+        printf("[RENDER   ] %s in %.4lf seconds: %ld pixels in the cardioid or bulb, %ld found periodic, %ld filled by tracing, %ld mirrored\n",
+            frame->resume ? "Resumed frame done" : "Frame done",
+            nanos_diff(frame->start, end)/(double)1000000000,
+            atomic_load(&frame->in_bulb), atomic_load(&frame->periodic),
+            atomic_load(&frame->traced), atomic_load(&frame->mirrored));
+    if (frame->tier == TIER_MPFR)
+        mpfr_clears(frame->x_hp, frame->y_hp, frame->dx_hp, frame->dy_hp,
+                NULL);
+    if (frame->ref != NULL)
+        reference_orbit_release(frame->ref);
+    palette_release(frame->palette);
+    if (atomic_load(&frame->abandoned))
+        atomic_store(&state->cut_short, true);
+    struct render_frame *old = atomic_exchange(&spare_frame, frame);
+    if (old != NULL)
+        free(old->order);
+    free(old);
+}
+
+static inline bool frame_stale(const struct render_frame *f)
+{ return atomic_load(&f->state->generation) != f->generation; }
+
+struct render_rect_args {
+    struct render_frame *frame;
+    SDL_Rect view;
+    bool allocated;  /* Not from the tile slab; freed when done */
+    bool ordered;  /* One of the pass's tiles: start the next in order */
+    /* A quarter of a traced tile, whose pixels that tile already set to be
+     * iterated */
+    bool split;
+    long key;  /* Its place in the tile order */
 };
 
+void *worker_render_rect(void *arguments);
+static void pass_tile_done(struct render_frame *frame);
+
+/* Copy the finished pixels in `view` to their mirror images below the real
+ * axis, where those are part of the frame: both the surface and the
+ * iteration buffer. A kept orbit mirrors to its conjugate, except a
+ * perturbed one: its delta is from a reference off the axis. */
+static void mirror_rect(struct render_frame *f, SDL_Rect view)
+{
+    SDL_Surface *img = f->img;
+    for (int py = view.y; py < view.y + view.h; py++) {
+        int mirror = f->mirror_k - py;
+        if (mirror < f->mirror_y0 || mirror > f->mirror_y1)
+            continue;
+        memcpy((uint8_t*) img->pixels + mirror*img->pitch + view.x*img->format->BytesPerPixel,
+                (uint8_t*) img->pixels + py*img->pitch + view.x*img->format->BytesPerPixel,
+                view.w * img->format->BytesPerPixel);
+        memcpy(f->iters + mirror*f->stride + view.x,
+                f->iters + py*f->stride + view.x, view.w * sizeof(int));
+        memcpy(f->escaped_abs_2 + mirror*f->stride + view.x,
+                f->escaped_abs_2 + py*f->stride + view.x,
+                view.w * sizeof(float));
+        for (int px = view.x; px < view.x + view.w; px++) {
+            struct orbit o = f->orbits[py*f->stride + px];
+            if (o.m >= 0 && f->tier == TIER_PERTURBATION) {
+                o.m = ORBIT_RESTART;
+            } else if (o.m >= 0) {
+                o.z_imag.hi = -o.z_imag.hi;
+                o.z_imag.lo = -o.z_imag.lo;
+            }
+            f->orbits[mirror*f->stride + px] = o;
+        }
+    }
+}
+
+/* The rows mirrored from those of `view`, or an empty rectangle if none are */
+static SDL_Rect mirror_image(const struct render_frame *f, SDL_Rect view)
+{
+    SDL_Rect mirrored = {view.x, f->mirror_k - (view.y + view.h - 1),
+        view.w, view.h};
+    if (mirrored.y < f->mirror_y0) {
+        mirrored.h -= f->mirror_y0 - mirrored.y;
+        mirrored.y = f->mirror_y0;
+    }
+    if (mirrored.y + mirrored.h - 1 > f->mirror_y1)
+        mirrored.h = f->mirror_y1 - mirrored.y + 1;
+    return mirrored;
+}
+
+/* Colour `view` from the iteration buffer, mirrored as above. Unless the
+ * frame goes stale, this colours each pixel of its final pass once, and
+ * nothing touches it after. */
+static void colour_frame_rect(struct render_frame *f, SDL_Rect view)
+{
+    colour_rect(f->img, view, f->iters, f->escaped_abs_2, f->stride,
+            f->palette, f->smooth);
+    mirror_rect(f, view);
+    if (f->state->png != NULL) {
+        SDL_Rect mirrored = mirror_image(f, view);
+        png_stream_done(f->state->png, view.y, view.w, view.h);
+        png_stream_done(f->state->png, mirrored.y, mirrored.w, mirrored.h);
+    }
+}
+
+/* Whether an earlier pass of the frame computed pixel (px, py) */
+static inline bool pixel_kept(const struct render_frame *f, int px, int py)
+{
+    return f->kept_step > 0 && px % f->kept_step == 0
+        && py % f->kept_step == 0;
+}
+
+/* Iteration counts of the pixels in `view` of the frame's grid spread out
+ * `step` times, so that its pixel (px, py) is the window's pixel
+ * (px*step, py*step), in the frame's tier. The counts and orbits are laid
+ * out as for the render_rect*() functions. With a power of two step the
+ * points are exactly those of the window's pixels. */
+static void iterate_grid(struct render_frame *f, int step, SDL_Rect view,
+        int *iters, float *abs_2, struct orbit *orbits, int stride,
+        struct escape_stats *stats)
+{
+    switch (f->tier) {
+        case TIER_DOUBLE:
+            render_rect(f->x, f->y, f->dx * step, f->dy * step, view,
+                    f->max_iter, iters, abs_2, orbits, stride, stats);
+            break;
+        case TIER_DOUBLE_DOUBLE:
+            render_rect_double_double(f->x_dd, f->y_dd, f->dx * step,
+                    f->dy * step, view, f->max_iter, iters, abs_2, orbits,
+                    stride, stats);
+            break;
+        case TIER_PERTURBATION:
+            render_rect_perturbation(f->ref, f->ref->x, f->ref->y,
+                    fe_mul_d(f->ref->dx, step), fe_mul_d(f->ref->dy, step),
+                    view, f->max_iter, iters, abs_2, orbits, stride, stats);
+            break;
+        case TIER_MPFR:
+            if (f->limbs > 0) {
+                struct mpn_fixed zero = {0}, dx, dy;
+                mpn_fixed_add_mul(&dx, &zero, &f->dx_mpn, step, f->limbs);
+                mpn_fixed_add_mul(&dy, &zero, &f->dy_mpn, step, f->limbs);
+                render_rect_mpn(&f->x_mpn, &f->y_mpn, &dx, &dy, f->limbs,
+                        view, f->max_iter, iters, abs_2, orbits, stride,
+                        stats);
+            } else {
+                mpfr_ptr dx = f->dx_hp, dy = f->dy_hp;
+                if (step > 1) {
+                    dx = hp_scratch->dx_step;
+                    dy = hp_scratch->dy_step;
+                    if (mpfr_get_prec(dx) != f->precision) {
+                        mpfr_set_prec(dx, f->precision);
+                        mpfr_set_prec(dy, f->precision);
+                    }
+                    mpfr_mul_si(dx, f->dx_hp, step, MPFR_RNDN);
+                    mpfr_mul_si(dy, f->dy_hp, step, MPFR_RNDN);
+                }
+                render_rect_high_precision(f->x_hp, f->y_hp, dx, dy, view,
+                        f->max_iter, f->precision, iters, abs_2, orbits,
+                        stride, stats);
+            }
+            break;
+    }
+}
+
+/* As iterate_grid(), a row at a time, giving up between rows once the
+ * frame is stale. Returns whether every row was done. */
+static bool iterate_rows(struct render_frame *f, int step, SDL_Rect view,
+        int *iters, float *abs_2, struct orbit *orbits, int stride,
+        struct escape_stats *stats)
+{
+    for (int row = 0; row < view.h; row++) {
+        if (frame_stale(f))
+            return false;
+        SDL_Rect line = {view.x, view.y + row, view.w, 1};
+        iterate_grid(f, step, line, iters + row*stride, abs_2 + row*stride,
+                orbits + row*stride, stride, stats);
+    }
+    return true;
+}
+
+/* Set the pixels of `view` to be iterated from the start, all but those an
+ * earlier pass computed */
+static void frame_reset(struct render_frame *f, SDL_Rect view)
+{
+    for (int py = view.y; py < view.y + view.h; py++) {
+        bool kept_row = f->kept_step > 0 && py % f->kept_step == 0;
+        for (int px = view.x; px < view.x + view.w; px++) {
+            if (kept_row && px % f->kept_step == 0)
+                continue;
+            f->iters[py*f->stride + px] = 0;
+            f->orbits[py*f->stride + px].m = ORBIT_RESTART;
+        }
+    }
+}
+
+/* What a tile of a stale frame does instead of its work: set the pixels it
+ * was to compute, and their mirror images, to start again, so that a later
+ * frame finishes them. Frames that only resume or recolour leave pixels
+ * pending as they were, and a stale frame's coarse passes leave it to its
+ * final pass, which it skips straight to. */
+static void frame_abandon(struct render_frame *f, SDL_Rect view)
+{
+    atomic_store(&f->abandoned, true);
+    if (f->resume || f->colour_only || f->step > 1)
+        return;
+    frame_reset(f, view);
+    SDL_Rect mirrored = mirror_image(f, view);
+    if (mirrored.h > 0)
+        frame_reset(f, mirrored);
+}
+
+/* Iteration counts of the pixels in `view` in the frame's tier, into the
+ * iteration buffer, carrying on each pixel's orbit as it stands: pixels
+ * already done are left alone. Returns false if the frame went stale
+ * first. */
+static bool frame_iterate_pending(struct render_frame *f, SDL_Rect view,
+        struct escape_stats *stats)
+{
+    int stride = f->stride;
+    int *iters = f->iters + view.y*stride + view.x;
+    float *abs_2 = f->escaped_abs_2 + view.y*stride + view.x;
+    struct orbit *orbits = f->orbits + view.y*stride + view.x;
+    return iterate_rows(f, 1, view, iters, abs_2, orbits, stride, stats);
+}
+
+/* As frame_iterate_pending(), but unless the frame resumes, the pixels'
+ * orbits are started again first, all but those an earlier pass
+ * computed */
+static bool frame_iterate(struct render_frame *f, SDL_Rect view,
+        struct escape_stats *stats)
+{
+    if (!f->resume)
+        frame_reset(f, view);
+    return frame_iterate_pending(f, view, stats);
+}
+
+/* One tile of a progressive pass: compute the pixels of `view` on the
+ * pass's grid, through scratch buffers as they aren't adjacent in the
+ * window's, and paint every pixel of `view` the colour of the grid pixel at
+ * or up and left of it. Along the tile's top and left edges, pixels before
+ * the first grid row or column take its colour instead, so that no tile
+ * reads another's pixels. Painted rows are mirrored like computed ones. */
+static void coarse_rect(struct render_frame *f, SDL_Rect view,
+        struct escape_stats *stats)
+{
+    int s = f->step;
+    SDL_Rect grid = {(view.x + s - 1) / s, (view.y + s - 1) / s};
+    grid.w = (view.x + view.w - 1) / s - grid.x + 1;
+    grid.h = (view.y + view.h - 1) / s - grid.y + 1;
+    if (grid.w <= 0 || grid.h <= 0)
+        return;
+
+    struct worker_scratch *scratch = &worker_scratch;
+    worker_scratch_reserve(scratch, grid.w * grid.h, view.w);
+    int *iters = scratch->iters;
+    float *abs_2 = scratch->abs_2;
+    struct orbit *orbits = scratch->orbits;
+    for (int row = 0; row < grid.h; row++) {
+        for (int col = 0; col < grid.w; col++) {
+            int px = (grid.x + col) * s, py = (grid.y + row) * s;
+            int i = row*grid.w + col, j = py*f->stride + px;
+            if (pixel_kept(f, px, py)) {
+                iters[i] = f->iters[j];
+                abs_2[i] = f->escaped_abs_2[j];
+                orbits[i] = f->orbits[j];
+            } else {
+                iters[i] = 0;
+                abs_2[i] = 0;
+                orbits[i].m = ORBIT_RESTART;
+            }
+        }
+    }
+    bool done = iterate_rows(f, s, grid, iters, abs_2, orbits, grid.w,
+            stats);
+    /* Rows not done are as gathered, so they can go back either way */
+    for (int row = 0; row < grid.h; row++) {
+        for (int col = 0; col < grid.w; col++) {
+            int i = row*grid.w + col;
+            int j = (grid.y + row)*s*f->stride + (grid.x + col)*s;
+            f->iters[j] = iters[i];
+            f->escaped_abs_2[j] = abs_2[i];
+            f->orbits[j] = orbits[i];
+        }
+    }
+    if (!done) {
+        frame_abandon(f, view);
+        return;
+    }
+
+    SDL_Surface *img = f->img;
+    uint32_t *colours = scratch->colours, *line = scratch->line;
+    int line_row = -1;
+    for (int py = view.y; py < view.y + view.h; py++) {
+        int row = py / s - grid.y;
+        if (row < 0)
+            row = 0;
+        if (row != line_row) {
+            palette_colour_row(f->palette, iters + row*grid.w,
+                    abs_2 + row*grid.w, f->smooth, grid.w, colours);
+            for (int px = view.x; px < view.x + view.w; px++) {
+                int col = px / s - grid.x;
+                line[px - view.x] = colours[col < 0 ? 0 : col];
+            }
+            line_row = row;
+        }
+        memcpy((uint8_t*) img->pixels + py*img->pitch + view.x*img->format->BytesPerPixel,
+                line, view.w * sizeof(uint32_t));
+        int mirror = f->mirror_k - py;
+        if (mirror >= f->mirror_y0 && mirror <= f->mirror_y1)
+            memcpy((uint8_t*) img->pixels + mirror*img->pitch + view.x*img->format->BytesPerPixel,
+                    line, view.w * sizeof(uint32_t));
+    }
+}
+
+/* Tile descriptors come from a slab of TILE_SLAB_CHUNKS chunks of
+ * TILE_SLAB_CHUNK, each allocated when first needed and then kept. The slab
+ * is emptied whenever no frame is in flight, which render_cancel() sees to
+ * before every render, so descriptors are never freed one by one. Any past
+ * its end are allocated. */
+#define TILE_SLAB_CHUNK 1024
+#define TILE_SLAB_CHUNKS 64
+
+static struct {
+    atomic_int used;
+    _Atomic(struct render_rect_args *) chunks[TILE_SLAB_CHUNKS];
+} tile_slab;
+
+static struct render_rect_args *tile_args_new(void)
+{
+    int i = atomic_fetch_add(&tile_slab.used, 1);
+    struct render_rect_args *args;
+    if (i >= TILE_SLAB_CHUNK * TILE_SLAB_CHUNKS) {
+        args = malloc(sizeof(struct render_rect_args));
+        args->allocated = true;
+        return args;
+    }
+    _Atomic(struct render_rect_args *) *chunk
+        = &tile_slab.chunks[i / TILE_SLAB_CHUNK];
+    struct render_rect_args *tiles = atomic_load(chunk);
+    if (tiles == NULL) {
+        /* Whichever tile gets here first allocates the chunk */
+        struct render_rect_args *fresh = malloc(sizeof(struct render_rect_args)
+                * TILE_SLAB_CHUNK);
+        if (atomic_compare_exchange_strong(chunk, &tiles, fresh))
+            tiles = fresh;
+        else
+            free(fresh);
+    }
+    args = &tiles[i % TILE_SLAB_CHUNK];
+    args->allocated = false;
+    return args;
+}
+
+/* Queue one quarter of a traced tile on the frame's work queue */
+static void queue_tile(struct render_frame *frame, SDL_Rect view,
+        void *(*render_func)(void*))
+{
+    struct render_rect_args *args = tile_args_new();
+    render_frame_retain(frame);
+    atomic_fetch_add(&frame->pass_tiles, 1);
+    args->frame = frame;
+    args->view = view;
+    args->ordered = false;
+    args->split = true;
+    queue_add(frame->q, render_func, args);
+}
+
+/* Index of cell (x, y) along a Hilbert curve through an n x n grid, for n a
+ * power of two */
+static long hilbert_index(int n, int x, int y)
+{
+    long d = 0;
+    for (int s = n / 2; s > 0; s /= 2) {
+        int rx = (x & s) > 0, ry = (y & s) > 0;
+        d += (long) s * s * ((3 * rx) ^ ry);
+        /* Turn the quadrant so the curve through it starts where the last
+         * one ended */
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            int t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+static long tile_order_key(const struct render_frame *f, SDL_Rect view)
+{
+    int cx = view.x + view.w/2, cy = view.y + view.h/2;
+    if (f->tile_order == TILE_ORDER_CENTRE) {
+        long dx = cx - f->img->w/2, dy = cy - f->img->h/2;
+        return dx*dx + dy*dy;
+    }
+    if (f->tile_order == TILE_ORDER_HILBERT) {
+        int n = 1;
+        while (n < f->img->w || n < f->img->h)
+            n *= 2;
+        return hilbert_index(n, cx, cy);
+    }
+    return f->order_n;
+}
+
+/* Add a tile to the pass being queued */
+static void pass_add_tile(struct render_frame *frame, SDL_Rect view)
+{
+    if (frame->order_n == frame->order_size) {
+        frame->order_size = frame->order_size > 0 ? 2 * frame->order_size
+            : 256;
+        frame->order = realloc(frame->order,
+                sizeof(struct render_rect_args *) * frame->order_size);
+    }
+    struct render_rect_args *args = tile_args_new();
+    args->frame = frame;
+    args->view = view;
+    args->ordered = true;
+    args->split = false;
+    args->key = tile_order_key(frame, view);
+    frame->order[frame->order_n++] = args;
+}
+
+/* Move tiles[i] down the max-heap tiles[0..n-1] of keys to where it
+ * belongs */
+static void tile_heap_sift(struct render_rect_args **tiles, int i, int n)
+{
+    struct render_rect_args *tile = tiles[i];
+    for (int child = 2*i + 1; child < n; i = child, child = 2*i + 1) {
+        if (child + 1 < n && tiles[child + 1]->key > tiles[child]->key)
+            child++;
+        if (tiles[child]->key <= tile->key)
+            break;
+        tiles[i] = tiles[child];
+    }
+    tiles[i] = tile;
+}
+
+/* Sort tiles by key in place. A heapsort, as qsort() may allocate. */
+static void sort_tiles(struct render_rect_args **tiles, int n)
+{
+    for (int i = n/2 - 1; i >= 0; i--)
+        tile_heap_sift(tiles, i, n);
+    for (int end = n - 1; end > 0; end--) {
+        struct render_rect_args *top = tiles[0];
+        tiles[0] = tiles[end];
+        tiles[end] = top;
+        tile_heap_sift(tiles, 0, end);
+    }
+}
+
+/* Sort the pass's tiles into the frame's tile order and queue a task for
+ * each */
+static void pass_queue_tiles(struct render_frame *frame)
+{
+    int n = frame->order_n;
+    if (frame->tile_order != TILE_ORDER_SCAN)
+        sort_tiles(frame->order, n);
+    atomic_store(&frame->order_next, 0);
+    atomic_fetch_add(&frame->pass_tiles, n);
+    for (int i = 0; i < n; i++) {
+        render_frame_retain(frame);
+        queue_add(frame->q, frame->render_func, frame->order[i]);
+    }
+}
+
+/* Mariani-Silver subdivision: compute the border of `view` and, if every
+ * border pixel took the same number of iterations, fill the inside with
+ * that count instead of iterating it. The set and the bands of equal
+ * count are connected, so nothing can hide inside a uniform border.
+ * Otherwise the inside is split into quarters, each queued to trace its own
+ * border, so no pixel is computed twice.
+ *
+ * The whole tile is set to be iterated up front, unless it is a quarter
+ * (`split`) whose parent did that, so that pixels computed already, such
+ * as the parent's spot check, are kept rather than started again. */
+static void trace_rect(struct render_frame *f, SDL_Rect view, bool split,
+        struct escape_stats *stats)
+{
+    int w = view.w, h = view.h;
+    if (!split && !f->resume)
+        frame_reset(f, view);
+    if (w < TRACE_MIN_SIZE || h < TRACE_MIN_SIZE) {
+        if (frame_iterate_pending(f, view, stats))
+            colour_frame_rect(f, view);
+        else
+            frame_abandon(f, view);
+        return;
+    }
+
+    /* Top and bottom rows, then the left and right columns between them */
+    SDL_Rect border[4] = {
+        {view.x, view.y, w, 1},
+        {view.x, view.y + h - 1, w, 1},
+        {view.x, view.y + 1, 1, h - 2},
+        {view.x + w - 1, view.y + 1, 1, h - 2},
+    };
+    for (int i = 0; i < 4; i++) {
+        if (!frame_iterate_pending(f, border[i], stats)) {
+            frame_abandon(f, view);
+            return;
+        }
+        colour_frame_rect(f, border[i]);
+    }
+
+    SDL_Rect inside = {view.x + 1, view.y + 1, w - 2, h - 2};
+    int *corner = f->iters + view.y*f->stride + view.x;
+    struct orbit *orbit = f->orbits + view.y*f->stride + view.x;
+    int it = *corner;
+    bool uniform = true;
+    /* Whether the whole border was found interior */
+    bool interior = true;
+    for (int i = 0; i < w; i++) {
+        uniform = uniform && corner[i] == it
+            && corner[(h-1)*f->stride + i] == it;
+        interior = interior && orbit[i].m == ORBIT_INTERIOR
+            && orbit[(h-1)*f->stride + i].m == ORBIT_INTERIOR;
+    }
+    for (int i = 1; i < h - 1; i++) {
+        uniform = uniform && corner[i*f->stride] == it
+            && corner[i*f->stride + w - 1] == it;
+        interior = interior && orbit[i*f->stride].m == ORBIT_INTERIOR
+            && orbit[i*f->stride + w - 1].m == ORBIT_INTERIOR;
+    }
+    if (uniform && TRACE_SPOT_CHECK) {
+        SDL_Rect centre = {view.x + w/2, view.y + h/2, 1, 1};
+        if (!frame_iterate_pending(f, centre, stats)) {
+            frame_abandon(f, view);
+            return;
+        }
+        uniform = corner[(h/2)*f->stride + w/2] == it;
+    }
+    if (uniform) {
+        float abs_2 = f->escaped_abs_2[view.y*f->stride + view.x];
+        /* Filled pixels keep no orbit, so ones that reached max_iter are
+         * iterated from the start if it is raised */
+        int m = orbit_ended(it, f->max_iter, interior);
+        for (int row = inside.y; row < inside.y + inside.h; row++) {
+            for (int col = inside.x; col < inside.x + inside.w; col++) {
+                f->iters[row*f->stride + col] = it;
+                f->escaped_abs_2[row*f->stride + col] = abs_2;
+                f->orbits[row*f->stride + col].m = m;
+            }
+        }
+        colour_frame_rect(f, inside);
+        atomic_fetch_add(&f->traced, (long) inside.w * inside.h);
+        return;
+    }
+    int w_a = inside.w / 2, h_a = inside.h / 2;
+    SDL_Rect quarters[4] = {
+        {inside.x, inside.y, w_a, h_a},
+        {inside.x + w_a, inside.y, inside.w - w_a, h_a},
+        {inside.x, inside.y + h_a, w_a, inside.h - h_a},
+        {inside.x + w_a, inside.y + h_a, inside.w - w_a, inside.h - h_a},
+    };
+    for (int i = 0; i < 4; i++)
+        queue_tile(f, quarters[i], worker_render_rect);
+}
+
+void *worker_render_rect(void *arguments)
+{
+    struct render_rect_args *args = arguments;
+    struct render_frame *f = args->frame;
+    struct escape_stats stats = {0};
+    if (args->ordered)
+        args = f->order[atomic_fetch_add(&f->order_next, 1)];
+    if (frame_stale(f)) {
+        frame_abandon(f, args->view);
+    } else if (f->colour_only) {
+        colour_rect(f->img, args->view, f->iters, f->escaped_abs_2,
+                f->stride, f->palette, f->smooth);
+    } else if (f->step > 1) {
+        coarse_rect(f, args->view, &stats);
+    } else if (f->boundary_trace) {
+        trace_rect(f, args->view, args->split, &stats);
+    } else if (frame_iterate(f, args->view, &stats)) {
+        colour_frame_rect(f, args->view);
+    } else {
+        frame_abandon(f, args->view);
+    }
+    if (stats.in_bulb)
+        atomic_fetch_add(&f->in_bulb, stats.in_bulb);
+    if (stats.periodic)
+        atomic_fetch_add(&f->periodic, stats.periodic);
+    sdl_damage(f->state, args->view);
+    sdl_damage(f->state, mirror_image(f, args->view));
+    /* Before the frame goes, as the slab may be emptied once it has */
+    if (args->allocated)
+        free(args);
+    pass_tile_done(f);
+    render_frame_release(f);
+    return NULL;
+}
+
+void *exit_thread(void *return_value)
+{ pthread_exit(return_value); }
+
 void *worker_spin(void *ptr)
 {
-    /* TODO: run arbitrary work function passed via the queue. */
     struct spin_thread_args *spin = ptr;
-    void (*work_func)(void *);
-    void *work_args;
+    struct hp_scratch scratch;
     printf("[WORKER %02d] Worker start\n", spin->id);
-    while (true) {
-        queue_get(spin->q, &work_func, &work_args);
-        work_func(work_args);
-    }
+    hp_scratch_init(&scratch);
+    /* Workers leave through pthread_exit() in exit_thread() */
+    pthread_cleanup_push((void (*)(void *)) hp_scratch_clear, &scratch);
+    pthread_cleanup_push((void (*)(void *)) worker_scratch_clear,
+            &worker_scratch);
+    while (true)
+        queue_run_next(spin->q, spin->id);
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
     return NULL;
 }
 
-void *signal_finished(void *args)
+/* Start the planned workers on q, then bind the calling thread where the
+ * plan puts the main thread. Each worker's id and queue are set in `args`. */
+static void workers_start(const struct worker_placement *p, struct queue *q,
+        pthread_t *threads, struct spin_thread_args *args)
 {
-    pthread_cond_signal(args);
-    return NULL;
+    for (int i = 0; i < p->n_workers; i++) {
+        pthread_attr_t attr;
+        args[i].id = i;
+        args[i].q = q;
+        pthread_attr_init(&attr);
+        placement_worker_attr(p, i, &attr);
+        pthread_create(threads+i, &attr, worker_spin, &args[i]);
+        pthread_attr_destroy(&attr);
+    }
+    placement_bind_main(p);
 }
 
-void enqueue_render(struct queue *q, struct viewport_mapping view, SDL_Surface *img, int max_iter, void *(*render_func)(void*), bool total)
-{
-//    if (view.use_high_precision)
-//        printf("USING HIGH PRECISION!\n");
-    if (view.view.w > 64) {
-        SDL_Rect pix_a = {view.view.x, view.view.y, view.view.w/2, view.view.h};
-        SDL_Rect pix_b = {view.view.x+view.view.w/2, view.view.y, view.view.w-view.view.w/2, view.view.h};
-        struct viewport_mapping v1, v2;
-        v1.use_high_precision = v2.use_high_precision = view.use_high_precision;
-        v1.precision = v2.precision = view.precision;
-        if (view.use_high_precision) {
-//            mpfr_inits2(view.precision, v1.x_hp, v1.y_hp, v1.w_hp,
-//                    v1.h_hp, v2.x_hp, v2.y_hp, v2.w_hp, v2.h_hp, NULL);
-            mpfr_init2(v1.x_hp, v1.precision);
-            mpfr_init2(v1.y_hp, v1.precision);
-            mpfr_init2(v1.w_hp, v1.precision);
-            mpfr_init2(v1.h_hp, v1.precision);
-            mpfr_init2(v2.x_hp, v2.precision);
-            mpfr_init2(v2.y_hp, v2.precision);
-            mpfr_init2(v2.w_hp, v2.precision);
-            mpfr_init2(v2.h_hp, v2.precision);
-            mpfr_set(v1.x_hp, view.x_hp, MPFR_RNDN);
-            mpfr_set(v1.y_hp, view.y_hp, MPFR_RNDN);
-            mpfr_set(v1.h_hp, view.h_hp, MPFR_RNDN);
-            mpfr_set(v2.y_hp, view.y_hp, MPFR_RNDN);
-            mpfr_set(v2.h_hp, view.h_hp, MPFR_RNDN);
-            mpfr_div_si(v1.w_hp, view.w_hp, 2, MPFR_RNDN);
-            mpfr_set(v2.w_hp, v1.w_hp, MPFR_RNDN);
-            mpfr_add(v2.x_hp, view.x_hp, v2.w_hp, MPFR_RNDN);
-        } else {
-            v1 = v2 = view;
-            v1.w = view.w/2;
-            v2.w = view.w/2;
-            v2.x = view.x + v2.w;
-        }
-        v1.view = pix_a;
-        v2.view = pix_b;
-        enqueue_render(q, v1, img, max_iter, render_func, false);
-        enqueue_render(q, v2, img, max_iter, render_func, false);
+/* Let the workers finish the tasks queued so far, then end them */
+static void workers_stop(struct queue *q, pthread_t *threads, int n_workers)
+{
+    for (int i = 0; i < n_workers; i++) {
+        queue_add(q, exit_thread, NULL);
+    }
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Split `view` into tiles and add them to the pass. Every tile shares the
+ * frame's pixel grid, so only the pixel rectangles are split. Boundary
+ * tracing starts from bigger tiles, since it subdivides them itself. */
+static void enqueue_render(struct render_frame *frame, SDL_Rect view)
+{
+    int tile_w = frame->boundary_trace ? TRACE_TILE_W : 64;
+    int tile_h = frame->boundary_trace ? TRACE_TILE_H : 36;
+    if (view.w > tile_w) {
+        SDL_Rect pix_a = {view.x, view.y, view.w/2, view.h};
+        SDL_Rect pix_b = {view.x+view.w/2, view.y, view.w-view.w/2, view.h};
+        enqueue_render(frame, pix_a);
+        enqueue_render(frame, pix_b);
         return;
     }
-    if (view.view.h > 36) {
-        SDL_Rect pix_a = {view.view.x, view.view.y, view.view.w, view.view.h/2};
-        SDL_Rect pix_b = {view.view.x, view.view.y+view.view.h/2, view.view.w, view.view.h-view.view.h/2};
-        struct viewport_mapping v1, v2;
-        v1.use_high_precision = v2.use_high_precision = view.use_high_precision;
-        v1.precision = v2.precision = view.precision;
-        if (view.use_high_precision) {
-//            mpfr_inits2(view.precision, v1.x_hp, v1.y_hp, v1.w_hp,
-//                    v1.h_hp, v2.x_hp, v2.y_hp, v2.w_hp, v2.h_hp, NULL);
-            mpfr_init2(v1.x_hp, v1.precision);
-            mpfr_init2(v1.y_hp, v1.precision);
-            mpfr_init2(v1.w_hp, v1.precision);
-            mpfr_init2(v1.h_hp, v1.precision);
-            mpfr_init2(v2.x_hp, v2.precision);
-            mpfr_init2(v2.y_hp, v2.precision);
-            mpfr_init2(v2.w_hp, v2.precision);
-            mpfr_init2(v2.h_hp, v2.precision);
-            mpfr_set(v1.x_hp, view.x_hp, MPFR_RNDN);
-            mpfr_set(v1.y_hp, view.y_hp, MPFR_RNDN);
-            mpfr_set(v1.w_hp, view.w_hp, MPFR_RNDN);
-            mpfr_set(v2.x_hp, view.x_hp, MPFR_RNDN);
-            mpfr_set(v2.w_hp, view.w_hp, MPFR_RNDN);
-            mpfr_div_si(v1.h_hp, view.h_hp, 2, MPFR_RNDN);
-            mpfr_set(v2.h_hp, v1.h_hp, MPFR_RNDN);
-            mpfr_add(v2.y_hp, view.y_hp, v2.h_hp, MPFR_RNDN);
-        } else {
-            v1 = v2 = view;
-            v1.h = view.h/2;
-            v2.h = view.h/2;
-            v2.y = view.y + v2.h;
+    if (view.h > tile_h) {
+        SDL_Rect pix_a = {view.x, view.y, view.w, view.h/2};
+        SDL_Rect pix_b = {view.x, view.y+view.h/2, view.w, view.h-view.h/2};
+        enqueue_render(frame, pix_a);
+        enqueue_render(frame, pix_b);
+        return;
+    }
+    pass_add_tile(frame, view);
+}
+
+/* Estimated costs of the pixels of an area, sampled on a grid and summed so
+ * that any rectangle's total takes four lookups */
+struct cost_map {
+    int spacing;  /* Pixels whose coordinates are multiples of this */
+    int x0, y0, w, h;  /* Samples (x0 + i)*spacing, (y0 + j)*spacing */
+    /* sums[j*(w+1) + i] is the total of the samples left of i and above j.
+     * They are kept in the worker's scratch. */
+    long *sums;
+};
+
+/* Rough cost of pixel i in iterations, from what the buffer holds: the
+ * count it took last time for a fresh frame, or what is left below
+ * max_iter for a resumed one */
+static long pixel_cost(const struct render_frame *f, int i)
+{
+    int it = f->iters[i], m = f->orbits[i].m;
+    if (!f->resume)
+        return TILE_PIXEL_COST + (m == ORBIT_INTERIOR ? INTERIOR_COST : it);
+    if (m == ORBIT_ESCAPED || m == ORBIT_INTERIOR || it >= f->max_iter)
+        return TILE_PIXEL_COST;
+    return TILE_PIXEL_COST + f->max_iter - it;
+}
+
+static void cost_map_init(struct cost_map *map, const struct render_frame *f,
+        SDL_Rect area, int spacing)
+{
+    map->spacing = spacing;
+    map->x0 = (area.x + spacing - 1) / spacing;
+    map->y0 = (area.y + spacing - 1) / spacing;
+    map->w = (area.x + area.w - 1) / spacing - map->x0 + 1;
+    map->h = (area.y + area.h - 1) / spacing - map->y0 + 1;
+    if (map->w < 0)
+        map->w = 0;
+    if (map->h < 0)
+        map->h = 0;
+    struct worker_scratch *scratch = &worker_scratch;
+    long size = (long) (map->w + 1) * (map->h + 1);
+    if (size > scratch->sums_size) {
+        free(scratch->cost_sums);
+        scratch->cost_sums = malloc(sizeof(long) * size);
+        scratch->sums_size = size;
+    }
+    map->sums = scratch->cost_sums;
+    for (int i = 0; i <= map->w; i++)
+        map->sums[i] = 0;
+    for (int j = 0; j < map->h; j++) {
+        long row = 0;
+        map->sums[(j+1)*(map->w+1)] = 0;
+        int py = (map->y0 + j) * spacing;
+        for (int i = 0; i < map->w; i++) {
+            row += pixel_cost(f, py*f->stride + (map->x0 + i) * spacing);
+            map->sums[(j+1)*(map->w+1) + i+1] = map->sums[j*(map->w+1) + i+1]
+                + row;
         }
-        v1.view = pix_a;
-        v2.view = pix_b;
-        enqueue_render(q, v1, img, max_iter, render_func, false);
-        enqueue_render(q, v2, img, max_iter, render_func, false);
+    }
+}
+
+/* Estimated cost of the pixels in `r` */
+static long cost_map_rect(const struct cost_map *map, SDL_Rect r)
+{
+    int s = map->spacing, stride = map->w + 1;
+    int i0 = (r.x + s - 1) / s - map->x0, i1 = (r.x + r.w - 1) / s - map->x0 + 1;
+    int j0 = (r.y + s - 1) / s - map->y0, j1 = (r.y + r.h - 1) / s - map->y0 + 1;
+    i0 = i0 < 0 ? 0 : i0;
+    j0 = j0 < 0 ? 0 : j0;
+    i1 = i1 > map->w ? map->w : i1;
+    j1 = j1 > map->h ? map->h : j1;
+    if (i1 <= i0 || j1 <= j0)
+        return 0;
+    return map->sums[j1*stride + i1] - map->sums[j0*stride + i1]
+        - map->sums[j1*stride + i0] + map->sums[j0*stride + i0];
+}
+
+/* As enqueue_render(), but go on halving `view` across its longer side, in
+ * 16:9 terms, while its estimated cost is over `target` */
+static void enqueue_costed(struct render_frame *frame, SDL_Rect view,
+        const struct cost_map *costs, long target)
+{
+    int step = frame->step;
+    bool split_w = view.w >= 2 * TILE_MIN_W * step;
+    bool split_h = view.h >= 2 * TILE_MIN_H * step;
+    bool split = view.w > TILE_MAX_W * step || view.h > TILE_MAX_H * step
+        || ((split_w || split_h) && cost_map_rect(costs, view) > target);
+    if (!split) {
+        pass_add_tile(frame, view);
         return;
     }
-    struct render_rect_args *args = malloc(sizeof(struct render_rect_args));
-    if (view.use_high_precision) {
-        mpfr_init2(args->x_hp, view.precision);
-        mpfr_init2(args->y_hp, view.precision);
-        mpfr_init2(args->w_hp, view.precision);
-        mpfr_init2(args->h_hp, view.precision);
-        mpfr_set(args->x_hp, view.x_hp, MPFR_RNDN);
-        mpfr_set(args->y_hp, view.y_hp, MPFR_RNDN);
-        mpfr_set(args->w_hp, view.w_hp, MPFR_RNDN);
-        mpfr_set(args->h_hp, view.h_hp, MPFR_RNDN);
+    SDL_Rect pix_a = view, pix_b = view;
+    if (view.w > TILE_MAX_W * step
+            || (split_w && (view.w * 9 >= view.h * 16 || !split_h))) {
+        pix_a.w = view.w / 2;
+        pix_b.x = view.x + pix_a.w;
+        pix_b.w = view.w - pix_a.w;
+    } else {
+        pix_a.h = view.h / 2;
+        pix_b.y = view.y + pix_a.h;
+        pix_b.h = view.h - pix_a.h;
+    }
+    enqueue_costed(frame, pix_a, costs, target);
+    enqueue_costed(frame, pix_b, costs, target);
+}
+
+/* Queue the tiles of the frame's area for its current pass. Rows that are
+ * mirrored aren't queued. The tiles are sized by their estimated cost,
+ * from the iteration buffer at the points of the first progressive pass:
+ * those this frame computed if it is past it, or else the last frame's.
+ * Boundary tracing balances itself as it subdivides, so keeps fixed
+ * tiles, and recolouring costs the same everywhere. Either way the tiles
+ * start in the frame's tile order. */
+static void queue_pass(struct render_frame *frame)
+{
+    SDL_Rect view = frame->area;
+    SDL_Rect parts[2] = {view};
+    int n = 1;
+    if (frame->mirror_y0 <= frame->mirror_y1) {
+        SDL_Rect above = {view.x, view.y, view.w, frame->mirror_y0 - view.y};
+        SDL_Rect below = {view.x, frame->mirror_y1 + 1, view.w,
+            view.y + view.h - frame->mirror_y1 - 1};
+        atomic_store(&frame->mirrored, (long) view.w
+                * (frame->mirror_y1 - frame->mirror_y0 + 1));
+        n = 0;
+        if (above.h > 0)
+            parts[n++] = above;
+        if (below.h > 0)
+            parts[n++] = below;
+    }
+    /* The last pass's tiles have all started */
+    frame->order_n = 0;
+    /* Hold the pass open until every tile is queued */
+    atomic_fetch_add(&frame->pass_tiles, 1);
+    if (frame->colour_only || (frame->boundary_trace && frame->step == 1)) {
+        for (int i = 0; i < n; i++)
+            enqueue_render(frame, parts[i]);
+    } else {
+        struct cost_map costs;
+        long total = 0;
+        cost_map_init(&costs, frame, view, PROGRESSIVE_STEP);
+        for (int i = 0; i < n; i++)
+            total += cost_map_rect(&costs, parts[i]);
+        long target = total / (frame->q->n_workers * TILES_PER_WORKER);
+        for (int i = 0; i < n; i++)
+            enqueue_costed(frame, parts[i], &costs, target);
+    }
+    pass_queue_tiles(frame);
+    pass_tile_done(frame);
+}
+
+/* Queue the frame's first pass from a worker, so that its tiles go on that
+ * worker's own deque rather than one at a time through the shared ring.
+ * Takes over a reference to the frame. */
+static void *queue_first_pass(void *arguments)
+{
+    struct render_frame *frame = arguments;
+    queue_pass(frame);
+    render_frame_release(frame);
+    return NULL;
+}
+
+/* Count one tile of the frame's current pass done. After the last tile of
+ * a coarse pass, queue the next pass at half the step. */
+static void pass_tile_done(struct render_frame *frame)
+{
+    struct timespec end;
+    if (atomic_fetch_sub(&frame->pass_tiles, 1) != 1 || frame->step == 1)
+        return;
+    if (atomic_load(&frame->abandoned)) {
+        /* Mark what is left from the last pass done in full */
+        frame->step = 1;
     } else {
-        args->x = view.x;
-        args->y = view.y;
-        args->w = view.w;
-        args->h = view.h;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("[RENDER   ] 1/%d of the pixels done in %.4lf seconds\n",
+                frame->step * frame->step,
+                nanos_diff(frame->start, end)/(double)1000000000);
+        frame->kept_step = frame->step;
+        frame->step /= 2;
     }
-    args->img = img;
-    args->view = view.view;
-    args->use_high_precision = view.use_high_precision;
-    args->precision = view.precision;
-    args->max_iter = max_iter;
-    queue_add(q, render_func, args);
-//    if (total)
-//        queue_add(q, &signal_finished, img->userdata);
+    queue_pass(frame);
 }
 
-void draw(struct sdl_window_info win, struct viewport_mapping *view)
+/* Prepare a deep-zoom render by perturbation: compute a reference orbit at
+ * the centre of the window's viewport and lay the surface's pixel grid out
+ * relative to it. */
+struct reference_orbit *perturbation_setup(struct sdl_window_info win)
 {
-    struct viewport_mapping v = win.v;
-    if (view != NULL) v = *view;
-    enqueue_render(win.q, v, win.surf, win.max_iter, win.func, true);
+    struct reference_orbit *ref;
+    mpfr_t c_real, c_imag, tmp;
+    mpfr_inits2(win.v.precision, c_real, c_imag, tmp, NULL);
+    mpfr_div_2ui(tmp, win.v.w_hp, 1, MPFR_RNDN);
+    mpfr_add(c_real, win.v.x_hp, tmp, MPFR_RNDN);
+    mpfr_div_2ui(tmp, win.v.h_hp, 1, MPFR_RNDN);
+    mpfr_add(c_imag, win.v.y_hp, tmp, MPFR_RNDN);
+    ref = reference_orbit_compute(c_real, c_imag, win.max_iter,
+            win.v.precision);
+
+    ref->dx = fe_mul_d(win.v.w_fe, 1.0 / win.v.view.w);
+    ref->dy = fe_mul_d(win.v.h_fe, 1.0 / win.v.view.h);
+    mpfr_sub(tmp, win.v.x_hp, c_real, MPFR_RNDN);
+    ref->x = fe_from_mpfr(tmp);
+    mpfr_sub(tmp, win.v.y_hp, c_imag, MPFR_RNDN);
+    ref->y = fe_from_mpfr(tmp);
+    mpfr_clears(c_real, c_imag, tmp, NULL);
+    return ref;
+}
+
+/* Double-doubles carry ~106 bits. Past a view 2^-90 wide (~1e-27) that leaves
+ * too few bits below the pixel spacing to survive thousands of iterations. */
+#define DOUBLE_DOUBLE_MIN_EXP -90
+
+/* Set up the pixel grid of the whole window in the cheapest tier that can
+ * still resolve it, or with colour_only just what recolouring the window
+ * from its iteration buffer needs. */
+struct render_frame *render_frame_create(struct sdl_window_info win,
+        bool colour_only)
+{
+    struct render_frame *frame = atomic_exchange(&spare_frame, NULL);
+    if (frame == NULL) {
+        frame = malloc(sizeof(struct render_frame));
+        frame->order = NULL;
+        frame->order_size = 0;
+    }
+    atomic_init(&frame->refs, 1);
+    atomic_init(&frame->in_bulb, 0);
+    atomic_init(&frame->periodic, 0);
+    atomic_init(&frame->traced, 0);
+    atomic_init(&frame->mirrored, 0);
+    frame->boundary_trace = win.use_boundary_trace;
+    frame->tile_order = win.tile_order;
+    frame->q = win.q;
+    frame->render_func = win.func;
+    frame->step = 1;
+    frame->kept_step = 0;
+    atomic_init(&frame->pass_tiles, 0);
+    frame->state = win.render;
+    frame->generation = atomic_load(&win.render->generation);
+    atomic_init(&frame->abandoned, false);
+    /* No tile is left to use the slab */
+    if (task_group_finished(&win.render->tasks))
+        atomic_store(&tile_slab.used, 0);
+    clock_gettime(CLOCK_MONOTONIC, &frame->start);
+    frame->img = win.surf;
+    frame->iters = win.iters;
+    frame->escaped_abs_2 = win.escaped_abs_2;
+    frame->orbits = win.orbits;
+    frame->stride = win.v.view.w;
+    frame->max_iter = win.max_iter;
+    frame->palette = palette_get(win.max_iter, win.colouring.hue_offset);
+    frame->smooth = win.colouring.smooth;
+    frame->colour_only = colour_only;
+    frame->resume = false;
+    frame->precision = win.v.precision;
+    frame->ref = NULL;
+    frame->mirror_k = -1;
+    frame->mirror_y0 = 1;
+    frame->mirror_y1 = 0;
+    if (colour_only) {
+        /* Only the buffer is needed, not a pixel grid */
+        frame->tier = TIER_DOUBLE;
+        return frame;
+    }
+    /* The width alone picks double-double; the `m` toggle only chooses how
+     * views too deep for it are computed */
+    if (!win.v.use_high_precision)
+        frame->tier = TIER_DOUBLE;
+    else if (win.v.w_fe.e >= DOUBLE_DOUBLE_MIN_EXP
+            && win.v.h_fe.e >= DOUBLE_DOUBLE_MIN_EXP)
+        frame->tier = TIER_DOUBLE_DOUBLE;
+    else if (win.use_perturbation)
+        frame->tier = TIER_PERTURBATION;
+    else
+        frame->tier = TIER_MPFR;
+
+    switch (frame->tier) {
+        case TIER_DOUBLE:
+            frame->x = win.v.x;
+            frame->y = win.v.y;
+            frame->dx = win.v.w / win.v.view.w;
+            frame->dy = win.v.h / win.v.view.h;
+            break;
+        case TIER_DOUBLE_DOUBLE:
+            frame->x_dd = dd_from_mpfr(win.v.x_hp);
+            frame->y_dd = dd_from_mpfr(win.v.y_hp);
+            frame->dx = mpfr_get_d(win.v.w_hp, MPFR_RNDN) / win.v.view.w;
+            frame->dy = mpfr_get_d(win.v.h_hp, MPFR_RNDN) / win.v.view.h;
+            break;
+        case TIER_PERTURBATION:
+            frame->ref = perturbation_setup(win);
+            break;
+        case TIER_MPFR:
+            mpfr_inits2(frame->precision, frame->x_hp, frame->y_hp,
+                    frame->dx_hp, frame->dy_hp, NULL);
+            mpfr_set(frame->x_hp, win.v.x_hp, MPFR_RNDN);
+            mpfr_set(frame->y_hp, win.v.y_hp, MPFR_RNDN);
+            mpfr_div_si(frame->dx_hp, win.v.w_hp, win.v.view.w, MPFR_RNDN);
+            mpfr_div_si(frame->dy_hp, win.v.h_hp, win.v.view.h, MPFR_RNDN);
+            frame->limbs = mpn_fixed_limbs(frame->precision);
+            if (frame->limbs > 0) {
+                mpn_fixed_from_mpfr(&frame->x_mpn, frame->x_hp, frame->limbs);
+                mpn_fixed_from_mpfr(&frame->y_mpn, frame->y_hp, frame->limbs);
+                mpn_fixed_from_mpfr(&frame->dx_mpn, frame->dx_hp,
+                        frame->limbs);
+                mpn_fixed_from_mpfr(&frame->dy_mpn, frame->dy_hp,
+                        frame->limbs);
+            }
+            break;
+    }
+    return frame;
 }
 
-void redraw(struct sdl_window_info win, struct viewport_mapping *view)
+/* Queue the tiles of `view` for the frame, starting at the frame's step.
+ * Where the view straddles the real axis only the rows above it and those
+ * without a mirror image in the view are queued. */
+static void queue_frame(struct sdl_window_info win,
+        struct render_frame *frame, SDL_Rect view)
 {
-    if (view == NULL)
+    int k = viewport_mirror(win);
+    frame->mirror_k = k;
+    if (k >= 0) {
+        /* Rows past the axis whose mirror image is in the area */
+        frame->mirror_y0 = k/2 + 1 > view.y ? k/2 + 1 : view.y;
+        frame->mirror_y1 = k - view.y < view.y + view.h - 1 ? k - view.y
+            : view.y + view.h - 1;
+    }
+    frame->area = view;
+    queue_add_group(frame->q, &frame->state->tasks, queue_first_pass, frame);
+}
+
+/* Render `area` of the window, or all of it if NULL: progressively, if the
+ * window is set to, so a coarse image shows long before the full one */
+void draw(struct sdl_window_info win, SDL_Rect *area)
+{
+    struct render_frame *frame = render_frame_create(win, false);
+    if (win.use_progressive)
+        frame->step = PROGRESSIVE_STEP;
+    queue_frame(win, frame, area != NULL ? *area : win.v.view);
+}
+
+/* Bring the whole window up to win.max_iter from the iteration buffer:
+ * escaped and interior pixels are only recoloured, and the rest carry on
+ * from where they stopped. For raising max_iter, and after a zoom that kept
+ * pixels in the buffer. */
+void draw_further(struct sdl_window_info win)
+{
+    struct render_frame *frame = render_frame_create(win, false);
+    frame->resume = true;
+    queue_frame(win, frame, win.v.view);
+}
+
+/* Recolour the whole window from the iteration buffer, in parallel */
+void recolour(struct sdl_window_info win)
+{
+    struct render_frame *frame = render_frame_create(win, true);
+    frame->area = win.v.view;
+    queue_add_group(frame->q, &frame->state->tasks, queue_first_pass, frame);
+}
+
+void redraw(struct sdl_window_info win, SDL_Rect *area)
+{
+    if (area == NULL)
         sdl_blank_screen(win, win.v.view);
     else
-        sdl_blank_screen(win, view->view);
-//    SDL_UpdateWindowSurface(win.win)
-    draw(win, view);
+        sdl_blank_screen(win, *area);
+    draw(win, area);
+}
+
+/* Called once every frame queued so far is through: how long the workers
+ * took, and how much of that time they spent rendering */
+static void render_finished(struct task_group *g, void *data)
+{
+    struct queue *q = data;
+    long busy = atomic_load(&g->busy_nanos);
+    printf("[RENDER   ] Caught up in %.4lf seconds, workers busy for %.4lf seconds (%.0lf%% of %d)\n",
+            g->elapsed_nanos/(double)1000000000, busy/(double)1000000000,
+            100.0 * busy / ((double) g->elapsed_nanos * q->n_workers),
+            q->n_workers);
+}
+
+/* Make every frame in flight stale and wait for their tiles to get through
+ * the workers, after which nothing else touches the window's buffers. Stale
+ * tiles stop within a row and then only mark their pixels, so this is
+ * quick. Call before changing the buffers or starting a frame. */
+void render_cancel(struct sdl_window_info win)
+{
+    atomic_fetch_add(&win.render->generation, 1);
+    task_group_wait(&win.render->tasks);
+}
+
+/* Renders asked for while handling one batch of events, cheapest first.
+ * They are merged into one, so a held key costs a frame per batch rather
+ * than one per key repeat. */
+enum render_kind {
+    RENDER_NONE,
+    RENDER_RECOLOUR,  /* Recolour the window from the buffer */
+    RENDER_AREA,  /* Draw one strip afresh */
+    RENDER_FURTHER,  /* Finish every pixel the buffer leaves pending */
+    RENDER_FULL,  /* Draw the whole window afresh */
+};
+
+struct render_request {
+    enum render_kind kind;
+    SDL_Rect area;  /* For RENDER_AREA */
+};
+
+/* Merge a render into the request. A render does what any cheaper one
+ * would, but a strip together with anything else is finished from the
+ * buffer, where viewport_mv() marks it: another move shifts it, and other
+ * renders cover the whole window. */
+void request_render(struct render_request *req, enum render_kind kind,
+        SDL_Rect *area)
+{
+    if (req->kind == RENDER_NONE) {
+        req->kind = kind;
+        if (area != NULL)
+            req->area = *area;
+        return;
+    }
+    if ((kind == RENDER_AREA || req->kind == RENDER_AREA)
+            && kind < RENDER_FURTHER)
+        kind = RENDER_FURTHER;
+    if (kind > req->kind)
+        req->kind = kind;
+}
+
+/* Start the requested render, after stopping whatever is in flight. If a
+ * frame was cut short, the pixels it left are only pending in the buffer,
+ * so nothing less than finishing the whole buffer will do. */
+void render_requested(struct sdl_window_info win, struct render_request *req)
+{
+    if (req->kind == RENDER_NONE)
+        return;
+    render_cancel(win);
+    if (atomic_exchange(&win.render->cut_short, false)
+            && req->kind < RENDER_FURTHER)
+        req->kind = RENDER_FURTHER;
+    switch (req->kind) {
+        case RENDER_RECOLOUR:
+            recolour(win);
+            break;
+        case RENDER_AREA:
+            redraw(win, &req->area);
+            break;
+        case RENDER_FURTHER:
+            draw_further(win);
+            break;
+        case RENDER_FULL:
+        case RENDER_NONE:
+            draw(win, NULL);
+            break;
+    }
+    /* For the preview or blanking drawn before the render */
+    sdl_damage(win.render, win.v.view);
+    req->kind = RENDER_NONE;
+}
+
+/* Zoom the window, showing the new view's preview at once, and ask for its
+ * pixels that weren't kept */
+void zoom(struct sdl_window_info *win, enum ZOOM_DIR dir,
+        struct render_request *req)
+{
+    render_cancel(*win);
+    request_render(req, viewport_zoom(win, dir) ? RENDER_FURTHER
+            : RENDER_FULL, NULL);
+}
+
+/* Move the window and ask for the strip it uncovers */
+void move(struct sdl_window_info *win, enum MV_DIR dir,
+        struct render_request *req)
+{
+    SDL_Rect area;
+    render_cancel(*win);
+    viewport_mv(win, dir, &area);
+    request_render(req, RENDER_AREA, &area);
+}
+
+/* Time the high-precision kernels on the same tile of a view at moderate
+ * depth, and count the pixels where each disagrees with MPFR. Single
+ * threaded and without a window: `mandelbrot --bench`. */
+int benchmark(void)
+{
+    const int w = 160, h = 90, max_iter = 1000;
+    const long precision = 160;
+    SDL_Rect view = {0, 0, w, h};
+    int *ref_iters = malloc(sizeof(int) * w * h);
+    int *iters = malloc(sizeof(int) * w * h);
+    struct timespec start, end;
+    mpfr_t x, y, dx, dy;
+    struct FPReal x_fp, y_fp, dx_fp, dy_fp;
+    struct mpn_fixed x_mpn, y_mpn, dx_mpn, dy_mpn;
+    struct hp_scratch scratch;
+    struct escape_stats stats = {0};
+    int limbs;
+    long nanos_mpfr;
+    char name[32];
+
+    /* A 1e-20 wide view on the edge of the seahorse valley */
+    mpfr_inits2(precision, x, y, dx, dy, NULL);
+    mpfr_set_str(x, "-0.743643887037158704752191506114774", 10, MPFR_RNDN);
+    mpfr_set_str(y, "0.131825904205311970492590416227", 10, MPFR_RNDN);
+    mpfr_set_d(dx, 1e-20 / w, MPFR_RNDN);
+    mpfr_set_d(dy, 1e-20 / w, MPFR_RNDN);
+    setMpfrN(FP_WIDTH_WORDS, &x_fp, x);
+    setMpfrN(FP_WIDTH_WORDS, &y_fp, y);
+    setMpfrN(FP_WIDTH_WORDS, &dx_fp, dx);
+    setMpfrN(FP_WIDTH_WORDS, &dy_fp, dy);
+
+    hp_scratch_init(&scratch);
+    limbs = mpn_fixed_limbs(precision);
+    mpn_fixed_from_mpfr(&x_mpn, x, limbs);
+    mpn_fixed_from_mpfr(&y_mpn, y, limbs);
+    mpn_fixed_from_mpfr(&dx_mpn, dx, limbs);
+    mpn_fixed_from_mpfr(&dy_mpn, dy, limbs);
+
+    printf("[BENCH    ] %dx%d pixels, %d iterations, 1e-20 wide\n", w, h,
+            max_iter);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    render_rect_high_precision(x, y, dx, dy, view, max_iter, precision,
+            ref_iters, NULL, NULL, w, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nanos_mpfr = nanos_diff(start, end);
+    snprintf(name, sizeof(name), "MPFR (%ld bits)", precision);
+    printf("[BENCH    ] %-22s %8.4lf seconds\n", name,
+            nanos_mpfr/(double)1000000000);
+
+    for (int kernel = 0; kernel < 3; kernel++) {
+        long nanos, mismatches = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (kernel == 0) {
+            snprintf(name, sizeof(name), "fixed point (%d words)",
+                    FP_WIDTH_WORDS);
+            render_rect_fixed(&x_fp, &y_fp, &dx_fp, &dy_fp, view, max_iter,
+                    iters, w);
+        } else if (kernel == 1) {
+            snprintf(name, sizeof(name), "mpn (%d limbs)", limbs);
+            render_rect_mpn(&x_mpn, &y_mpn, &dx_mpn, &dy_mpn, limbs, view,
+                    max_iter, iters, NULL, NULL, w, &stats);
+        } else {
+            snprintf(name, sizeof(name), "double-double");
+            render_rect_double_double(dd_from_mpfr(x), dd_from_mpfr(y),
+                    mpfr_get_d(dx, MPFR_RNDN), mpfr_get_d(dy, MPFR_RNDN),
+                    view, max_iter, iters, NULL, NULL, w, &stats);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        nanos = nanos_diff(start, end);
+        for (int i = 0; i < w * h; i++)
+            mismatches += iters[i] != ref_iters[i];
+        printf("[BENCH    ] %-22s %8.4lf seconds (%.1fx MPFR), %ld pixels differ\n",
+                name, nanos/(double)1000000000, nanos_mpfr/(double)nanos,
+                mismatches);
+    }
+    hp_scratch_clear(&scratch);
+    mpfr_clears(x, y, dx, dy, NULL);
+    free(ref_iters);
+    free(iters);
+    return 0;
+}
+
+/* The frame rendered by benchmark_workers(), split into tiles */
+static struct {
+    double x, y, d;
+    int *iters;
+    SDL_Rect *tiles;
+    int n_tiles;
+} bench_frame;
+
+static void *bench_render_tile(void *arguments)
+{
+    SDL_Rect view = *(SDL_Rect *) arguments;
+    struct escape_stats stats = {0};
+    render_rect(bench_frame.x, bench_frame.y, bench_frame.d, bench_frame.d,
+            view, BENCH_MAX_ITER, bench_frame.iters + view.y*IMG_WIDTH
+            + view.x, NULL, NULL, IMG_WIDTH, &stats);
+    return NULL;
+}
+
+/* Queued as one task, so that the group can't finish before every tile is
+ * queued, and the tiles go on a worker's own deque */
+static void *bench_queue_tiles(void *q)
+{
+    for (int i = 0; i < bench_frame.n_tiles; i++)
+        queue_add(q, bench_render_tile, &bench_frame.tiles[i]);
+    return NULL;
+}
+
+/* Split the seahorse valley frame into the window's 64x36 tiles */
+static void bench_frame_init(void)
+{
+    const int tile_w = 64, tile_h = 36;
+    bench_frame.d = 0.02 / IMG_WIDTH;
+    bench_frame.x = -0.7436 - bench_frame.d * IMG_WIDTH / 2;
+    bench_frame.y = 0.1318 - bench_frame.d * IMG_HEIGHT / 2;
+    bench_frame.iters = malloc(sizeof(int) * IMG_WIDTH * IMG_HEIGHT);
+    bench_frame.tiles = malloc(sizeof(SDL_Rect) * (IMG_WIDTH/tile_w + 1)
+            * (IMG_HEIGHT/tile_h + 1));
+    bench_frame.n_tiles = 0;
+    for (int y = 0; y < IMG_HEIGHT; y += tile_h)
+        for (int x = 0; x < IMG_WIDTH; x += tile_w)
+            bench_frame.tiles[bench_frame.n_tiles++] = (SDL_Rect) {x, y,
+                x + tile_w < IMG_WIDTH ? tile_w : IMG_WIDTH - x,
+                y + tile_h < IMG_HEIGHT ? tile_h : IMG_HEIGHT - y};
+}
+
+static void bench_frame_clear(void)
+{
+    free(bench_frame.iters);
+    free(bench_frame.tiles);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/* Compare the throughput of the worker placements: unpinned and pinned, one
+ * worker per logical CPU and one per core, each with `n_workers` workers
+ * if it isn't 0. Renders the same frame in double precision repeatedly and
+ * reports the median: `mandelbrot --bench-workers [--workers N]`. */
+int benchmark_workers(int n_workers)
+{
+    char name[96];
+    /* The CPUs the process may use, for the main thread to go back to
+     * between placements, as each plan starts from the main thread's */
+    struct worker_placement unbound;
+    placement_init(&unbound, 0, false, SMT_THREADS);
+
+    bench_frame_init();
+
+    printf("[BENCH    ] %dx%d pixels, %d iterations, %d frames each\n",
+            IMG_WIDTH, IMG_HEIGHT, BENCH_MAX_ITER, BENCH_FRAMES);
+    for (int policy = 0; policy < 4; policy++) {
+        struct worker_placement p;
+        struct task_group g;
+        long elapsed[BENCH_FRAMES], total = 0, busy = 0;
+        placement_init(&p, n_workers, policy >= 2,
+                policy % 2 ? SMT_CORES : SMT_THREADS);
+        struct queue *q = queue_init(p.n_workers);
+        pthread_t threads[p.n_workers];
+        struct spin_thread_args args[p.n_workers];
+        workers_start(&p, q, threads, args);
+        task_group_init(&g, NULL, NULL);
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            queue_add_group(q, &g, bench_queue_tiles, q);
+            task_group_wait(&g);
+            elapsed[i] = g.elapsed_nanos;
+            total += g.elapsed_nanos;
+            busy += atomic_load(&g.busy_nanos);
+        }
+        qsort(elapsed, BENCH_FRAMES, sizeof(long), compare_long);
+        placement_describe(&p, name, sizeof(name));
+        printf("[BENCH    ] %-56s %8.2lf Mpixels/s, workers %.0lf%% busy\n",
+                name, IMG_WIDTH * IMG_HEIGHT
+                / (elapsed[BENCH_FRAMES/2] / (double)1000),
+                100.0 * busy / ((double) total * p.n_workers));
+        workers_stop(q, threads, p.n_workers);
+        task_group_destroy(&g);
+        queue_destroy(q);
+        placement_clear(&p);
+        placement_bind_main(&unbound);
+    }
+    placement_clear(&unbound);
+    bench_frame_clear();
+    return 0;
+}
+
+static atomic_long bench_pool_sink;
+
+/* A task too small for its work to hide the pool's own cost */
+static void *bench_pool_leaf(void *arguments)
+{
+    unsigned long x = (uintptr_t) arguments;
+    for (int i = 0; i < BENCH_POOL_WORK; i++)
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    atomic_fetch_add_explicit(&bench_pool_sink, x >> 63,
+            memory_order_relaxed);
+    return NULL;
+}
+
+static struct queue *bench_pool_queue;
+
+/* Split `n` leaves in halves from a worker, as boundary tracing does */
+static void *bench_pool_split(void *arguments)
+{
+    uintptr_t n = (uintptr_t) arguments;
+    if (n == 1)
+        return bench_pool_leaf(arguments);
+    queue_add(bench_pool_queue, bench_pool_split, (void *) (n / 2));
+    queue_add(bench_pool_queue, bench_pool_split, (void *) (n - n / 2));
+    return NULL;
+}
+
+/* The median time over BENCH_FRAMES runs of `func(args)` as one task of a
+ * group, including the tasks it adds */
+static double bench_pool_median(struct queue *q, void *(*func)(void *),
+        void *args)
+{
+    struct task_group g;
+    long elapsed[BENCH_FRAMES];
+    task_group_init(&g, NULL, NULL);
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        queue_add_group(q, &g, func, args);
+        task_group_wait(&g);
+        elapsed[i] = g.elapsed_nanos;
+    }
+    task_group_destroy(&g);
+    qsort(elapsed, BENCH_FRAMES, sizeof(long), compare_long);
+    return elapsed[BENCH_FRAMES/2];
+}
+
+/* Queued as one task, so that the group can't finish before every leaf is
+ * queued */
+static void *bench_pool_flat(void *q)
+{
+    for (uintptr_t t = 0; t < BENCH_POOL_TASKS; t++)
+        queue_add(q, bench_pool_leaf, (void *) t);
+    return NULL;
+}
+
+/* Compare the work-stealing pool with the single locked list it replaced,
+ * at 1, 2, 4, ... workers, up to `n_workers` or one per logical CPU. Each
+ * renders the `--bench-workers` frame tile by tile, and runs tasks that do
+ * almost nothing, both added in a loop and split recursively, to time the
+ * pool itself. Reports the medians: `mandelbrot --bench-pool [--workers N]`.
+ */
+int benchmark_pool(int n_workers)
+{
+    struct worker_placement unbound;
+    placement_init(&unbound, n_workers, false, SMT_THREADS);
+    int max_workers = unbound.n_workers;
+
+    bench_frame_init();
+    printf("[BENCH    ] %dx%d pixels, %d iterations, in %d tiles; "
+            "%d tasks of %d LCG steps; %d runs each, CPUs: %d\n",
+            IMG_WIDTH, IMG_HEIGHT, BENCH_MAX_ITER, bench_frame.n_tiles,
+            BENCH_POOL_TASKS, BENCH_POOL_WORK, BENCH_FRAMES,
+            unbound.n_main_cpus);
+    for (int n = 1; n <= max_workers; n = n < max_workers
+            && n * 2 > max_workers ? max_workers : n * 2) {
+        for (int locked = 1; locked >= 0; locked--) {
+            struct worker_placement p;
+            placement_init(&p, n, false, SMT_THREADS);
+            struct queue *q = locked ? queue_init_locked(p.n_workers)
+                : queue_init(p.n_workers);
+            pthread_t threads[p.n_workers];
+            struct spin_thread_args args[p.n_workers];
+            bench_pool_queue = q;
+            workers_start(&p, q, threads, args);
+            double tiles = bench_pool_median(q, bench_queue_tiles, q);
+            double flat = bench_pool_median(q, bench_pool_flat, q);
+            double split = bench_pool_median(q, bench_pool_split,
+                    (void *) (uintptr_t) BENCH_POOL_TASKS);
+            printf("[BENCH    ] %3d workers, %-13s %8.2lf Mpixels/s, "
+                    "%7.1lf ns/task flat, %7.1lf ns/task recursive\n",
+                    p.n_workers, locked ? "locked list" : "work-stealing",
+                    IMG_WIDTH * IMG_HEIGHT / (tiles / 1000),
+                    flat / BENCH_POOL_TASKS, split / BENCH_POOL_TASKS);
+            workers_stop(q, threads, p.n_workers);
+            queue_destroy(q);
+            placement_clear(&p);
+            placement_bind_main(&unbound);
+        }
+    }
+    placement_clear(&unbound);
+    bench_frame_clear();
+    return 0;
+}
+
+/* What `mandelbrot --output PATH` renders. The view is given by decimal
+ * strings, or if NULL that of a new window. */
+struct headless_job {
+    const char *path;
+    const char *centre_x, *centre_y, *width;
+    int w, h;
+    int max_iter;
+    int png_level;
+    enum row_filter png_filter;
+};
+
+static void headless_tasks_done(struct task_group *g, void *data)
+{
+    png_stream_idle(data);
+}
+
+/* Render one image on the worker pool without a window, never initialising
+ * SDL, and write it to a PNG. Rows are encoded by the same workers as the
+ * tiles finish them, so most of the file is written by the time the last
+ * tile is done. Returns the exit status. */
+static int render_headless(const struct headless_job *job,
+        const struct worker_placement *p)
+{
+    struct timespec start, end;
+    struct png_stream_stats stats;
+    char default_x[32], default_w[32], placement_name[96];
+    snprintf(default_x, sizeof(default_x), "%.17g", (X_MIN + X_MAX) / 2);
+    snprintf(default_w, sizeof(default_w), "%.17g", X_MAX - X_MIN);
+    struct sdl_window_info win = sdl_headless_init(X_MIN, 0, X_MAX - X_MIN,
+            0, job->w, job->h, job->max_iter, &worker_render_rect);
+    if (!viewport_set(&win, job->centre_x != NULL ? job->centre_x
+                : default_x, job->centre_y != NULL ? job->centre_y : "0",
+                job->width != NULL ? job->width : default_w)) {
+        fprintf(stderr, "ERROR: the centre and width must be numbers, and "
+                "the width positive\n");
+        sdl_headless_free(&win);
+        return 1;
+    }
+    /* Tiles start top down, so bands are mostly finished in the order they
+     * are written rather than held for the ones above */
+    win.tile_order = TILE_ORDER_SCAN;
+    escape_kernel_init();
+    printf("[MASTER   ] Using the %s escape-time kernel\n", escape_kernel_name());
+    if (win.v.use_high_precision)
+        printf("[MASTER   ] High precision, %ld bits\n", win.v.precision);
+
+    placement_describe(p, placement_name, sizeof(placement_name));
+    printf("[MASTER   ] Creating worker threads: %s\n", placement_name);
+    struct queue *q = queue_init(p->n_workers);
+    pthread_t threads[p->n_workers];
+    struct spin_thread_args args[p->n_workers];
+    win.q = q;
+    win.render->png = png_stream_open(job->path, job->w, job->h,
+            win.surf->pixels, win.surf->pitch, job->png_level,
+            job->png_filter, q);
+    if (win.render->png == NULL) {
+        fprintf(stderr, "ERROR: failed to open %s\n", job->path);
+        queue_destroy(q);
+        sdl_headless_free(&win);
+        return 1;
+    }
+    workers_start(p, q, threads, args);
+
+    /* Encoding tasks are queued by tiles, so are in the render's group,
+     * and once it finishes there are no more bands to wait for */
+    win.render->tasks.on_done = headless_tasks_done;
+    win.render->tasks.data = win.render->png;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    draw(win, NULL);
+    /* This thread writes the bands out while the workers render */
+    png_stream_write(win.render->png);
+    task_group_wait(&win.render->tasks);
+    int status = png_stream_close(win.render->png, &stats) == 0 ? 0 : 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long nanos = nanos_diff(start, end);
+    long busy = atomic_load(&win.render->tasks.busy_nanos);
+    workers_stop(q, threads, p->n_workers);
+    queue_destroy(q);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: failed to write %s\n", job->path);
+    } else {
+        printf("[MASTER   ] Wrote %s: %dx%d pixels, %d iterations in %.4lf seconds, %.2lf Mpixels/s, workers %.0lf%% busy\n",
+                job->path, job->w, job->h, job->max_iter,
+                nanos/(double)1000000000,
+                (double) job->w * job->h / (nanos/(double)1000),
+                100.0 * busy / ((double) nanos * p->n_workers));
+        printf("[PNG      ] %d bands of %d rows, level %d, %s filter: %.2lf MB of rows to %.2lf MB (%.1lf%%)\n",
+                stats.n_bands, stats.band_rows, job->png_level,
+                row_filter_name(job->png_filter), stats.raw_bytes / 1e6,
+                stats.out_bytes / 1e6,
+                100.0 * stats.out_bytes / stats.raw_bytes);
+        printf("[PNG      ] Encoding took %.4lf CPU seconds, %.2lf MB/s (%.2lf Mpixels/s) a worker, and finished %.4lf seconds after the last row\n",
+                stats.encode_nanos/(double)1000000000,
+                stats.raw_bytes / (stats.encode_nanos/(double)1000),
+                (double) job->w * job->h / (stats.encode_nanos/(double)1000),
+                stats.tail_nanos/(double)1000000000);
+    }
+    win.render->png = NULL;
+    sdl_headless_free(&win);
+    mpfr_free_cache();
+    return status;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--workers N] [--pin] [--smt cores|threads] "
+            "[--max-fps N]\n"
+            "           [--bench | --bench-workers | --bench-pool]\n"
+            "       %s --output PATH [--centre X Y] [--width W] "
+            "[--size WxH] [--max-iter N]\n"
+            "           [--png-level N] [--png-filter NAME] "
+            "[placement options]\n"
+            "  --workers N  Start N worker threads (default: one per CPU "
+            "the --smt policy allows)\n"
+            "  --pin        Pin each worker to a CPU, keeping one core for "
+            "the main thread\n"
+            "  --smt cores  One worker per physical core\n"
+            "  --smt threads  One worker per logical CPU (the default)\n"
+            "  --max-fps N  Present the window at most N times a second "
+            "(default: %d)\n"
+            "  --bench      Time the high-precision kernels\n"
+            "  --bench-workers  Compare the throughput of each placement\n"
+            "  --bench-pool  Compare the task pool with the locked queue\n"
+            "  --output PATH  Render one image to a PNG without a window\n"
+            "  --centre X Y  Centre it on X + Y*i, to any number of digits "
+            "(default: %.17g 0)\n"
+            "  --width W    Make it W wide on the complex plane (default: "
+            "%.17g)\n"
+            "  --size WxH   Make it W by H pixels (default: %dx%d)\n"
+            "  --max-iter N  Iterate each pixel up to N times (default: %d)\n"
+            "  --png-level N  Compress the PNG at zlib level N, 0-9 "
+            "(default: %d)\n"
+            "  --png-filter none|sub|up|average|paeth|adaptive  Filter its "
+            "rows so (default: %s)\n",
+            name, name, MAX_FPS, (X_MIN + X_MAX) / 2, X_MAX - X_MIN,
+            IMG_WIDTH, IMG_HEIGHT, MAX_ITER, PNG_LEVEL,
+            row_filter_name(PNG_FILTER));
 }
 
 int main(int argc, char ** argv) {
-    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_workers = 0, max_fps = MAX_FPS;
+    bool pin = false, bench = false, bench_workers = false, bench_pool = false;
+    enum smt_policy smt = SMT_THREADS;
+    struct headless_job job = {NULL, NULL, NULL, NULL, IMG_WIDTH, IMG_HEIGHT,
+        MAX_ITER, PNG_LEVEL, PNG_FILTER};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--bench-workers") == 0) {
+            bench_workers = true;
+        } else if (strcmp(argv[i], "--bench-pool") == 0) {
+            bench_pool = true;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin = true;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc
+                && atoi(argv[i+1]) > 0) {
+            n_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc
+                && atoi(argv[i+1]) > 0) {
+            max_fps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            job.path = argv[++i];
+        } else if (strcmp(argv[i], "--centre") == 0 && i + 2 < argc) {
+            job.centre_x = argv[++i];
+            job.centre_y = argv[++i];
+        } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            job.width = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc
+                && sscanf(argv[i+1], "%dx%d", &job.w, &job.h) == 2
+                && job.w > 0 && job.h > 0) {
+            i++;
+        } else if (strcmp(argv[i], "--max-iter") == 0 && i + 1 < argc
+                && atoi(argv[i+1]) > 0) {
+            job.max_iter = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc
+                && sscanf(argv[i+1], "%d", &job.png_level) == 1
+                && job.png_level >= 0 && job.png_level <= 9) {
+            i++;
+        } else if (strcmp(argv[i], "--png-filter") == 0 && i + 1 < argc) {
+            int f = 0;
+            while (f < ROW_FILTERS && strcmp(argv[i+1], row_filter_name(f)))
+                f++;
+            if (f == ROW_FILTERS) {
+                usage(argv[0]);
+                return 1;
+            }
+            job.png_filter = f;
+            i++;
+        } else if (strcmp(argv[i], "--smt") == 0 && i + 1 < argc
+                && (strcmp(argv[i+1], smt_policy_name(SMT_CORES)) == 0
+                    || strcmp(argv[i+1], smt_policy_name(SMT_THREADS)) == 0)) {
+            smt = strcmp(argv[++i], smt_policy_name(SMT_CORES)) == 0
+                ? SMT_CORES : SMT_THREADS;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench) {
+        escape_kernel_init();
+        return benchmark();
+    }
+    if (bench_workers) {
+        escape_kernel_init();
+        return benchmark_workers(n_workers);
+    }
+    if (bench_pool) {
+        escape_kernel_init();
+        return benchmark_pool(n_workers);
+    }
 
+    struct worker_placement placement;
+    placement_init(&placement, n_workers, pin, smt);
+    if (job.path != NULL) {
+        int status = render_headless(&job, &placement);
+        placement_clear(&placement);
+        return status;
+    }
+    int nproc = placement.n_workers;
     pthread_t threads[nproc];
 
     // Time how long things take
@@ -367,21 +2176,24 @@ int main(int argc, char ** argv) {
     struct sdl_window_info window = my_sdl_init(X_MIN, y_min, X_MAX-X_MIN,
             y_max-y_min, IMG_WIDTH, IMG_HEIGHT, MAX_ITER, &worker_render_rect);
 
-    printf("[MASTER   ] Creating worker threads...\n");
+    window.colouring.hue_offset = HUE_OFFSET;
+    escape_kernel_init();
+    printf("[MASTER   ] Using the %s escape-time kernel\n", escape_kernel_name());
+
+    char placement_name[96];
+    placement_describe(&placement, placement_name, sizeof(placement_name));
+    printf("[MASTER   ] Creating worker threads: %s\n", placement_name);
     clock_gettime(CLOCK_REALTIME, &start);
-    struct queue *task_queue = queue_init();
+    struct queue *task_queue = queue_init(nproc);
     window.q = task_queue;
+    window.render->tasks.on_done = render_finished;
+    window.render->tasks.data = task_queue;
     struct spin_thread_args thread_args[nproc];
     for (int i = 0; i < nproc; i++) {
-        thread_args[i].id = i;
-        thread_args[i].q = task_queue;
         thread_args[i].img_surf = window.surf;
         thread_args[i].keep_window_open = &window.keep_open;
     }
-
-    for (int i = 0; i < nproc; i++) {
-        pthread_create(threads+i, NULL, worker_spin, &thread_args[i]);
-    }
+    workers_start(&placement, task_queue, threads, thread_args);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("[MASTER   ] Created threads in %.04lf seconds\n", nanos_diff(start, end)/(double)1000000000);
 
@@ -392,14 +2204,29 @@ int main(int argc, char ** argv) {
     printf("[MASTER   ] Created work queue in %.04lf seconds\n", nanos_diff(start, end)/(double)1000000000);
 
     long eventloop_i = 0;
-    struct viewport_mapping redraw_area;
+    struct render_request req = {RENDER_NONE};
+    long present_nanos = 1000000000L / max_fps;
+    struct timespec last_present = {0}, now;
     while (window.keep_open) {
         SDL_Event e;
-        while (SDL_PollEvent(&e) > 0) {
+        /* Sleep until there is input or something new to present, but
+         * present no more often than every present_nanos */
+        int timeout = -1;
+        if (sdl_damaged(window)) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long wait = present_nanos - nanos_diff(last_present, now);
+            timeout = wait > 0 ? (wait + 999999) / 1000000 : 0;
+        }
+        bool have_event = SDL_WaitEventTimeout(&e, timeout) > 0;
+        for (; have_event; have_event = SDL_PollEvent(&e) > 0) {
             switch (e.type) {
                 case SDL_QUIT:
                     window.keep_open = false;
                     break;
+                case SDL_WINDOWEVENT:
+                    if (e.window.event == SDL_WINDOWEVENT_EXPOSED)
+                        sdl_damage(window.render, window.v.view);
+                    break;
                 case SDL_KEYDOWN:
                     switch (e.key.keysym.sym) {
                         case SDLK_q:
@@ -407,34 +2234,27 @@ int main(int argc, char ** argv) {
                             break;
                         case SDLK_r:
                             my_sdl_reset(&window);
-                            redraw(window, NULL);
+                            request_render(&req, RENDER_FULL, NULL);
                             break;
                         case SDLK_i:
                         case SDLK_t:
-                            viewport_zoom(&window, ZOOM_IN);
-                            // TODO: Automatically switch to high-precision when width < 0.0000000000005
-                            redraw(window, NULL);
+                            zoom(&window, ZOOM_IN, &req);
                             break;
                         case SDLK_o:
                         case SDLK_g:
-                            viewport_zoom(&window, ZOOM_OUT);
-                            redraw(window, NULL);
+                            zoom(&window, ZOOM_OUT, &req);
                             break;
                         case SDLK_h:
-                            viewport_mv(&window, MV_LEFT, &redraw_area);
-                            redraw(window, &redraw_area);
+                            move(&window, MV_LEFT, &req);
                             break;
                         case SDLK_l:
-                            viewport_mv(&window, MV_RIGHT, &redraw_area);
-                            redraw(window, &redraw_area);
+                            move(&window, MV_RIGHT, &req);
                             break;
                         case SDLK_k:
-                            viewport_mv(&window, MV_UP, &redraw_area);
-                            redraw(window, &redraw_area);
+                            move(&window, MV_UP, &req);
                             break;
                         case SDLK_j:
-                            viewport_mv(&window, MV_DOWN, &redraw_area);
-                            redraw(window, &redraw_area);
+                            move(&window, MV_DOWN, &req);
                             break;
                         case SDLK_UP:
                             if (window.max_iter <= 128)
@@ -443,7 +2263,7 @@ int main(int argc, char ** argv) {
                                 window.max_iter += 128;
                             // TODO: Write iterations in a corner of the window
                             printf("[MASTER   ] Using %d iterations\n", window.max_iter);
-                            redraw(window, NULL);
+                            request_render(&req, RENDER_FURTHER, NULL);
                             break;
                         case SDLK_DOWN:
                             if (window.max_iter == 1)
@@ -453,40 +2273,73 @@ int main(int argc, char ** argv) {
                             else
                                 window.max_iter -= 128;
                             printf("[MASTER   ] Using %d iterations\n", window.max_iter);
-                            redraw(window, NULL);
+                            /* Counts past the new limit just show black */
+                            request_render(&req, RENDER_RECOLOUR, NULL);
                             break;
                         case SDLK_p:
                             toggle_high_precision(&window);
-                            redraw(window, NULL);
+                            request_render(&req, RENDER_FULL, NULL);
+                            break;
+                        case SDLK_m:
+                            window.use_perturbation = !window.use_perturbation;
+                            printf("[MASTER   ] Past double-double, deep "
+                                    "zoom %s\n", window.use_perturbation
+                                    ? "by perturbation"
+                                    : "with per-pixel MPFR");
+                            if (window.v.use_high_precision)
+                                request_render(&req, RENDER_FULL, NULL);
+                            break;
+                        case SDLK_s:
+                            window.colouring.smooth = !window.colouring.smooth;
+                            printf("[MASTER   ] Smooth colouring %s\n",
+                                    window.colouring.smooth ? "on" : "off");
+                            request_render(&req, RENDER_RECOLOUR, NULL);
+                            break;
+                        case SDLK_c:
+                            window.colouring.hue_offset = fmod(
+                                    window.colouring.hue_offset + 30, 360);
+                            request_render(&req, RENDER_RECOLOUR, NULL);
+                            break;
+                        case SDLK_b:
+                            window.use_boundary_trace = !window.use_boundary_trace;
+                            printf("[MASTER   ] Boundary tracing %s\n",
+                                    window.use_boundary_trace ? "on" : "off");
+                            request_render(&req, RENDER_FULL, NULL);
+                            break;
+                        case SDLK_v:
+                            window.use_progressive = !window.use_progressive;
+                            printf("[MASTER   ] Progressive rendering %s\n",
+                                    window.use_progressive ? "on" : "off");
+                            break;
+                        case SDLK_z:
+                            window.tile_order = (window.tile_order + 1) % 3;
+                            printf("[MASTER   ] Tiles start %s\n",
+                                    window.tile_order == TILE_ORDER_SCAN
+                                    ? "from the top left"
+                                    : window.tile_order == TILE_ORDER_CENTRE
+                                    ? "from the centre"
+                                    : "along a Hilbert curve");
                             break;
                     }
                     break;
             }
         }
-        SDL_UpdateWindowSurface(window.win);
-        SDL_Delay(33);
+        render_requested(window, &req);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (nanos_diff(last_present, now) >= present_nanos
+                && sdl_damaged(window)) {
+            sdl_present(window);
+            last_present = now;
+        }
         eventloop_i++;
     }
     mpfr_free_cache();
 
-    for (int i = 0; i < nproc; i++) {
-        queue_add(task_queue, exit_thread, NULL);
-    }
     printf("[MASTER   ] Waiting for workers to finish...\n");
     clock_gettime(CLOCK_REALTIME, &start);
-//    struct rendering_stats *stats_tmp, stats_total;
-//    stats_total.nanos_rendering = 0;
-//    stats_total.nanos_waiting = 0;
-    for (int i = 0; i < nproc; i++) {
-//        pthread_join(threads[i], (void*)&stats_tmp);
-        pthread_join(threads[i], NULL);
-//        stats_total.nanos_rendering += stats_tmp->nanos_rendering;
-//        stats_total.nanos_waiting += stats_tmp->nanos_waiting;
-    }
+    workers_stop(task_queue, threads, nproc);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("[MASTER   ] Workers finished in %.04lf seconds\n", nanos_diff(start, end)/(double)1000000000);
-//    printf("[MASTER   ] Workers spent a total of %.04lf seconds rendering and %.04lf seconds waiting\n", stats_total.nanos_rendering/(double)1000000000, stats_total.nanos_waiting/(double)1000000000);
-
-//    save_png_to_file(&image, "out/image.png");
+    placement_clear(&placement);
     return 0;
 }
@@ -0,0 +1,122 @@
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "palette.h"
+#include "png_maker.h"
+
+/* Kept by palette_get(), with a reference of its own */
+static struct palette *cached;
+
+static void (*colour_row_counts)(const uint32_t *colours, int max_iter,
+        const int *iters, int n, uint32_t *out);
+
+/* Colour at fractional iteration count `nu`: a hue around the colour wheel */
+static uint32_t hue_colour(double nu, int max_iter, double hue_offset)
+{
+    // normalize between 0 and 360 for hue.
+    double hue = fmod(360 * nu / (double) max_iter + hue_offset, 360);
+    if (hue < 0)
+        hue += 360;
+    struct HSV hsv = {hue, 1.0, 1.0};
+    struct RGB rgb = HSVToRGB(hsv);
+    return rgb.R << 16 | rgb.G << 8 | rgb.B;
+}
+
+static void colour_row_counts_scalar(const uint32_t *colours, int max_iter,
+        const int *iters, int n, uint32_t *out)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = colours[iters[i] < max_iter ? iters[i] : max_iter];
+}
+
+/* Eight table lookups at a time with a gather */
+__attribute__((target("avx2")))
+static void colour_row_counts_avx2(const uint32_t *colours, int max_iter,
+        const int *iters, int n, uint32_t *out)
+{
+    const __m256i limit = _mm256_set1_epi32(max_iter);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i it = _mm256_loadu_si256((const __m256i *)(iters + i));
+        it = _mm256_min_epi32(it, limit);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                _mm256_i32gather_epi32((const int *) colours, it, 4));
+    }
+    colour_row_counts_scalar(colours, max_iter, iters + i, n - i, out + i);
+}
+
+/* Blend two packed pixels, t of the way from a to b */
+static inline uint32_t blend(uint32_t a, uint32_t b, float t)
+{
+    uint32_t pixel = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        float c_a = (a >> shift) & 0xFF, c_b = (b >> shift) & 0xFF;
+        pixel |= (uint32_t) (c_a + t * (c_b - c_a) + 0.5f) << shift;
+    }
+    return pixel;
+}
+
+void palette_colour_row(const struct palette *p, const int *iters,
+        const float *escaped_abs_2, bool smooth, int n, uint32_t *out)
+{
+    if (!smooth) {
+        colour_row_counts(p->colours, p->max_iter, iters, n, out);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        int it = iters[i];
+        if (it >= p->max_iter) {
+            out[i] = p->colours[p->max_iter];
+            continue;
+        }
+        /* The fractional count is it + 1 - log2(log2(|z|)). With an escape
+         * radius of 2 that can dip a little below `it`, so clamp it. */
+        float t = 1 - log2f(0.5f * log2f(escaped_abs_2[i]));
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+        uint32_t next = it + 1 < p->max_iter ? p->colours[it+1] : p->wrap;
+        out[i] = blend(p->colours[it], next, t);
+    }
+}
+
+static struct palette *palette_build(int max_iter, double hue_offset)
+{
+    struct palette *p = malloc(sizeof(struct palette));
+    atomic_init(&p->refs, 1);
+    p->max_iter = max_iter;
+    p->hue_offset = hue_offset;
+    p->colours = malloc(sizeof(uint32_t) * (max_iter + 1));
+    for (int it = 0; it < max_iter; it++)
+        p->colours[it] = hue_colour(it, max_iter, hue_offset);
+    p->colours[max_iter] = 0;
+    p->wrap = hue_colour(max_iter, max_iter, hue_offset);
+    return p;
+}
+
+struct palette *palette_get(int max_iter, double hue_offset)
+{
+    if (colour_row_counts == NULL) {
+        __builtin_cpu_init();
+        colour_row_counts = __builtin_cpu_supports("avx2")
+            ? colour_row_counts_avx2 : colour_row_counts_scalar;
+    }
+    if (cached == NULL || cached->max_iter != max_iter
+            || cached->hue_offset != hue_offset) {
+        if (cached != NULL)
+            palette_release(cached);
+        cached = palette_build(max_iter, hue_offset);
+    }
+    palette_retain(cached);
+    return cached;
+}
+
+void palette_retain(struct palette *p)
+{ atomic_fetch_add(&p->refs, 1); }
+
+void palette_release(struct palette *p)
+{
+    if (atomic_fetch_sub(&p->refs, 1) != 1)
+        return;
+    free(p->colours);
+    free(p);
+}
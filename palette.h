@@ -0,0 +1,43 @@
+#ifndef __PALETTE_H
+#define __PALETTE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* How iteration counts are turned into colours */
+struct colouring {
+    double hue_offset;  /* Degrees around the colour wheel */
+    bool smooth;  /* Colour by fractional iteration count */
+};
+
+/* A palette compiled into a lookup table of packed 0xRRGGBB pixels for one
+ * max_iter: colours[it] is the colour of a pixel that escaped after `it`
+ * iterations and colours[max_iter] is black, for pixels that never escaped.
+ * `wrap` is the colour a fractional count of max_iter would get, so smooth
+ * colouring can blend towards it from colours[max_iter-1].
+ *
+ * A palette is never changed once built. Frames hold a reference to the one
+ * they were created with, and the last to release it frees it. */
+struct palette {
+    atomic_int refs;
+    int max_iter;
+    double hue_offset;
+    uint32_t wrap;
+    uint32_t *colours;
+};
+
+/* The palette for max_iter and hue_offset, with a reference for the caller.
+ * The last one built is cached, so this only rebuilds the table when either
+ * changes. Call from the main thread only. */
+struct palette *palette_get(int max_iter, double hue_offset);
+void palette_retain(struct palette *p);
+void palette_release(struct palette *p);
+
+/* Colour `n` pixels from their iteration counts into `out`. With smooth
+ * colouring escaped_abs_2 (|z|^2 just after escaping) gives each count a
+ * fractional part, blended between adjacent entries of the table. */
+void palette_colour_row(const struct palette *p, const int *iters,
+        const float *escaped_abs_2, bool smooth, int n, uint32_t *out);
+
+#endif
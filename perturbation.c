@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "perturbation.h"
+#include "escape_kernel.h"
+
+/* Series approximation tolerances: the cubic term may be at most
+ * SERIES_TOLERANCE of the linear one across the tile, and the series is only
+ * followed while |dz| stays below SERIES_MAX_DELTA, i.e. while the pixel is
+ * still indistinguishable from the reference at the scale of the set. |dz|
+ * must also stay small enough that no pixel can escape during the iterations
+ * being skipped. */
+#define SERIES_TOLERANCE 1e-12
+#define SERIES_MAX_DELTA 1e-3
+
+/* Build the series coefficients from the (double-rounded) reference orbit:
+ *     A_{n+1} = 2*Z_n*A_n + 1
+ *     B_{n+1} = 2*Z_n*B_n + A_n^2
+ *     C_{n+1} = 2*Z_n*C_n + 2*A_n*B_n
+ * starting from dz_1 = dc, i.e. A_1 = 1, B_1 = C_1 = 0. */
+static void series_compute(struct reference_orbit *ref)
+{
+    struct series_term *s = ref->series;
+    s[0] = (struct series_term) {0};
+    s[1] = (struct series_term) {.a_real = 1, .radius = HUGE_VAL};
+    for (int n = 1; n + 1 < ref->length; n++) {
+        double z_real = 2 * ref->z_real[n], z_imag = 2 * ref->z_imag[n];
+        struct series_term *t = s + n, *next = s + n + 1;
+        next->a_real = z_real * t->a_real - z_imag * t->a_imag + 1;
+        next->a_imag = z_real * t->a_imag + z_imag * t->a_real;
+        next->b_real = z_real * t->b_real - z_imag * t->b_imag
+            + t->a_real * t->a_real - t->a_imag * t->a_imag;
+        next->b_imag = z_real * t->b_imag + z_imag * t->b_real
+            + 2 * t->a_real * t->a_imag;
+        next->c_real = z_real * t->c_real - z_imag * t->c_imag
+            + 2 * (t->a_real * t->b_real - t->a_imag * t->b_imag);
+        next->c_imag = z_real * t->c_imag + z_imag * t->c_real
+            + 2 * (t->a_real * t->b_imag + t->a_imag * t->b_real);
+
+        double a_abs = hypot(next->a_real, next->a_imag);
+        double b_abs = hypot(next->b_real, next->b_imag);
+        double c_abs = hypot(next->c_real, next->c_imag);
+        double max_delta = fmin(SERIES_MAX_DELTA, 2 - hypot(
+                    ref->z_real[n+1], ref->z_imag[n+1]));
+        double radius = t->radius;
+        if (c_abs > 0)
+            radius = fmin(radius, sqrt(SERIES_TOLERANCE * a_abs / c_abs));
+        /* Bound each term of |dz| by a third of max_delta */
+        radius = fmin(radius, max_delta / (3 * a_abs));
+        radius = fmin(radius, sqrt(max_delta / (3 * b_abs)));
+        radius = fmin(radius, cbrt(max_delta / (3 * c_abs)));
+        /* Overflowing coefficients end the usable series */
+        if (!isfinite(a_abs) || !isfinite(b_abs) || !isfinite(c_abs)
+                || max_delta <= 0)
+            radius = 0;
+        next->radius = radius;
+    }
+}
+
+/* The last orbit released, kept with its arrays and MPFR numbers for the
+ * next to save allocating them */
+static _Atomic(struct reference_orbit *) spare_orbit;
+
+static void reference_orbit_free(struct reference_orbit *ref)
+{
+    mpfr_clears(ref->c_real, ref->c_imag, NULL);
+    for (int i = 0; i < 5; i++)
+        mpfr_clear(ref->work[i]);
+    free(ref->series);
+    free(ref->z_real);
+    free(ref->z_imag);
+    free(ref);
+}
+
+struct reference_orbit *reference_orbit_compute(mpfr_t c_real, mpfr_t c_imag,
+        int max_iter, long precision)
+{
+    struct reference_orbit *ref = atomic_exchange(&spare_orbit, NULL);
+    /* Pixels start at z_1 = c and may run for max_iter more iterations */
+    int capacity = max_iter + 2;
+
+    if (ref == NULL) {
+        ref = malloc(sizeof(struct reference_orbit));
+        ref->capacity = 0;
+        ref->z_real = ref->z_imag = NULL;
+        ref->series = NULL;
+        mpfr_inits2(precision, ref->c_real, ref->c_imag, NULL);
+        for (int i = 0; i < 5; i++)
+            mpfr_init2(ref->work[i], precision);
+    } else {
+        /* Only reallocates to grow */
+        mpfr_set_prec(ref->c_real, precision);
+        mpfr_set_prec(ref->c_imag, precision);
+        for (int i = 0; i < 5; i++)
+            mpfr_set_prec(ref->work[i], precision);
+    }
+    if (ref->capacity < capacity) {
+        ref->capacity = capacity;
+        ref->z_real = realloc(ref->z_real, sizeof(double) * capacity);
+        ref->z_imag = realloc(ref->z_imag, sizeof(double) * capacity);
+        ref->series = realloc(ref->series,
+                sizeof(struct series_term) * capacity);
+    }
+    mpfr_ptr z_real = ref->work[0], z_imag = ref->work[1];
+    mpfr_ptr z_real_2 = ref->work[2], z_imag_2 = ref->work[3];
+    mpfr_ptr tmp = ref->work[4];
+
+    atomic_init(&ref->refs, 1);
+    atomic_init(&ref->rebased, 0);
+    atomic_init(&ref->skipped, 0);
+    mpfr_set(ref->c_real, c_real, MPFR_RNDN);
+    mpfr_set(ref->c_imag, c_imag, MPFR_RNDN);
+
+    mpfr_set_zero(z_real, 1);
+    mpfr_set_zero(z_imag, 1);
+    ref->length = 0;
+    while (ref->length < capacity) {
+        ref->z_real[ref->length] = mpfr_get_d(z_real, MPFR_RNDN);
+        ref->z_imag[ref->length] = mpfr_get_d(z_imag, MPFR_RNDN);
+        ref->length++;
+        /* Z = Z^2 + C */
+        mpfr_sqr(z_real_2, z_real, MPFR_RNDN);
+        mpfr_sqr(z_imag_2, z_imag, MPFR_RNDN);
+        mpfr_mul(tmp, z_real, z_imag, MPFR_RNDN);
+        mpfr_mul_2ui(tmp, tmp, 1, MPFR_RNDN);
+        mpfr_add(z_imag, tmp, c_imag, MPFR_RNDN);
+        mpfr_sub(tmp, z_real_2, z_imag_2, MPFR_RNDN);
+        mpfr_add(z_real, tmp, c_real, MPFR_RNDN);
+        /* Stop once the reference escapes, but always keep Z_1 = C */
+        mpfr_sqr(z_real_2, z_real, MPFR_RNDN);
+        mpfr_sqr(z_imag_2, z_imag, MPFR_RNDN);
+        mpfr_add(tmp, z_real_2, z_imag_2, MPFR_RNDN);
+        if (ref->length >= 2 && mpfr_cmp_ui(tmp, MY_INFINITY) >= 0)
+            break;
+    }
+    series_compute(ref);
+    return ref;
+}
+
+void reference_orbit_retain(struct reference_orbit *ref)
+{ atomic_fetch_add(&ref->refs, 1); }
+
+void reference_orbit_release(struct reference_orbit *ref)
+{
+    if (atomic_fetch_sub(&ref->refs, 1) != 1)
+        return;
+    /* The last tile of the frame has finished with the orbit */
+    printf("[RENDER   ] Perturbation frame done: %d reference iterations, %ld pixels rebased, %ld iterations skipped\n",
+            ref->length, atomic_load(&ref->rebased),
+            atomic_load(&ref->skipped));
+    struct reference_orbit *old = atomic_exchange(&spare_orbit, ref);
+    if (old != NULL)
+        reference_orbit_free(old);
+}
+
+int reference_orbit_skip(const struct reference_orbit *ref, floatexp radius,
+        int max_iter)
+{
+    /* A pixel at reference index m has done m-1 iterations */
+    int lo = 1, hi = ref->length - 1;
+    if (hi > max_iter + 1)
+        hi = max_iter + 1;
+    /* Largest n in [lo, hi] with series[n].radius >= radius */
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        double valid = ref->series[mid].radius;
+        if (isinf(valid) || fe_cmp(fe_from_d(valid), radius) >= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Iterate a pixel in doubles from the delta dz against reference index m
+ * kept in `o`, having already done `it` iterations. Where it stops is left
+ * in `o`. If the pixel escapes, |z|^2 just after that is left in *abs_2.
+ *
+ * As in the escape-time kernels, z = Z_m + dz is compared against the z
+ * saved at power-of-two iterations, and an orbit that comes back within
+ * `eps` of it is taken to be periodic: the count goes to max_iter and
+ * *periodic is set. The difference is taken as (Z_m - Z_saved) + (dz -
+ * dz_saved), so that inside a deep minibrot, where the reference settles
+ * into the same cycle, it resolves offsets far below the ulp of z.
+ *
+ * When |z| drops below |dz| the delta has become as large as the value it
+ * perturbs and its low bits are garbage: that is the classic perturbation
+ * glitch. Instead of flagging the pixel for a second reference we rebase it
+ * onto the start of the same orbit (Z_0 = 0, dz = z), which keeps dz small
+ * relative to z. Running off the end of an escaped reference is handled the
+ * same way. */
+static int perturb_iterate(const struct reference_orbit *ref, struct orbit *o,
+        int it, double dc_real, double dc_imag, int max_iter, double eps,
+        bool *rebased, bool *periodic, double *abs_2)
+{
+    const double *ref_real = ref->z_real, *ref_imag = ref->z_imag;
+    double dz_real = o->z_real.hi, dz_imag = o->z_imag.hi;
+    int m = o->m;
+    double saved_real = MY_INFINITY, saved_imag = MY_INFINITY;
+    int saved_m = m, step = 0, check = 1;
+    while (it < max_iter) {
+        double z_real = ref_real[m] + dz_real;
+        double z_imag = ref_imag[m] + dz_imag;
+        double z_abs_2 = z_real * z_real + z_imag * z_imag;
+        if (z_abs_2 >= MY_INFINITY) {
+            *abs_2 = z_abs_2;
+            break;
+        }
+        /* Brent: compare against z saved at power-of-two iterations */
+        if (step == check) {
+            saved_real = dz_real;
+            saved_imag = dz_imag;
+            saved_m = m;
+            check *= 2;
+        } else if (fabs(ref_real[m] - ref_real[saved_m]
+                    + (dz_real - saved_real)) < eps
+                && fabs(ref_imag[m] - ref_imag[saved_m]
+                    + (dz_imag - saved_imag)) < eps) {
+            it = max_iter;
+            *periodic = true;
+            break;
+        }
+        step++;
+        if (z_abs_2 < dz_real * dz_real + dz_imag * dz_imag
+                || m == ref->length - 1) {
+            dz_real = z_real;
+            dz_imag = z_imag;
+            m = 0;
+            *rebased = true;
+        }
+        /* dz = (2*Z + dz)*dz + dc */
+        double t_real = 2 * ref_real[m] + dz_real;
+        double t_imag = 2 * ref_imag[m] + dz_imag;
+        double dz_real_new = t_real * dz_real - t_imag * dz_imag + dc_real;
+        dz_imag = t_real * dz_imag + t_imag * dz_real + dc_imag;
+        dz_real = dz_real_new;
+        m++;
+        it++;
+    }
+    *o = (struct orbit) {dd_from_d(dz_real), dd_from_d(dz_imag), m};
+    return it;
+}
+
+/* Iterate one pixel from reference index `skip`, with dz taken from the
+ * series approximation (at skip = 1 that is simply dz = dc, z_1 = c). */
+static int perturb_point(const struct reference_orbit *ref, int skip,
+        double dc_real, double dc_imag, int max_iter, double eps,
+        bool *rebased, bool *periodic, double *abs_2, struct orbit *o)
+{
+    const struct series_term *s = ref->series + skip;
+    /* dz = ((C*dc + B)*dc + A)*dc */
+    double p_real = s->c_real * dc_real - s->c_imag * dc_imag + s->b_real;
+    double p_imag = s->c_real * dc_imag + s->c_imag * dc_real + s->b_imag;
+    double q_real = p_real * dc_real - p_imag * dc_imag + s->a_real;
+    double q_imag = p_real * dc_imag + p_imag * dc_real + s->a_imag;
+    double dz_real = q_real * dc_real - q_imag * dc_imag;
+    double dz_imag = q_real * dc_imag + q_imag * dc_real;
+    *o = (struct orbit) {dd_from_d(dz_real), dd_from_d(dz_imag), skip};
+    return perturb_iterate(ref, o, skip - 1, dc_real, dc_imag, max_iter, eps,
+            rebased, periodic, abs_2);
+}
+
+/* Below this exponent a delta is kept as a floatexp; above it, it is well
+ * inside double range and any dc that needed a floatexp is negligible. */
+#define DELTA_DOUBLE_EXP (-500)
+/* Pixel spacings below this exponent need the floatexp path */
+#define SPACING_DOUBLE_EXP (-900)
+
+static inline void fe_complex_mul(floatexp *r_real, floatexp *r_imag,
+        floatexp a_real, floatexp a_imag, floatexp b_real, floatexp b_imag)
+{
+    *r_real = fe_sub(fe_mul(a_real, b_real), fe_mul(a_imag, b_imag));
+    *r_imag = fe_add(fe_mul(a_real, b_imag), fe_mul(a_imag, b_real));
+}
+
+/* perturb_point() for deltas beyond double's exponent range. The first
+ * iterations run in floatexp while dz is tiny; z is then indistinguishable
+ * from Z, so it can neither escape nor glitch. Once dz has grown into double
+ * range the pixel carries on in perturb_iterate(). */
+static int perturb_point_fe(const struct reference_orbit *ref, int skip,
+        floatexp dc_real, floatexp dc_imag, int max_iter, double eps,
+        bool *rebased, bool *periodic, double *abs_2, struct orbit *o)
+{
+    const struct series_term *s = ref->series + skip;
+    floatexp p_real, p_imag, dz_real, dz_imag;
+    fe_complex_mul(&p_real, &p_imag, fe_from_d(s->c_real),
+            fe_from_d(s->c_imag), dc_real, dc_imag);
+    p_real = fe_add(p_real, fe_from_d(s->b_real));
+    p_imag = fe_add(p_imag, fe_from_d(s->b_imag));
+    fe_complex_mul(&p_real, &p_imag, p_real, p_imag, dc_real, dc_imag);
+    p_real = fe_add(p_real, fe_from_d(s->a_real));
+    p_imag = fe_add(p_imag, fe_from_d(s->a_imag));
+    fe_complex_mul(&dz_real, &dz_imag, p_real, p_imag, dc_real, dc_imag);
+
+    int m = skip;
+    int it = skip - 1;
+    while (it < max_iter && m < ref->length - 1
+            && dz_real.e < DELTA_DOUBLE_EXP && dz_imag.e < DELTA_DOUBLE_EXP) {
+        /* dz = (2*Z + dz)*dz + dc */
+        floatexp t_real = fe_add(fe_from_d(2 * ref->z_real[m]), dz_real);
+        floatexp t_imag = fe_add(fe_from_d(2 * ref->z_imag[m]), dz_imag);
+        fe_complex_mul(&dz_real, &dz_imag, t_real, t_imag, dz_real, dz_imag);
+        dz_real = fe_add(dz_real, dc_real);
+        dz_imag = fe_add(dz_imag, dc_imag);
+        m++;
+        it++;
+    }
+    *o = (struct orbit) {dd_from_d(fe_to_d(dz_real)),
+        dd_from_d(fe_to_d(dz_imag)), m};
+    /* A delta still below double range can't be kept */
+    if (it >= max_iter && (dz_real.e < DELTA_DOUBLE_EXP
+                || dz_imag.e < DELTA_DOUBLE_EXP)) {
+        o->m = ORBIT_RESTART;
+        return it;
+    }
+    return perturb_iterate(ref, o, it, fe_to_d(dc_real), fe_to_d(dc_imag),
+            max_iter, eps, rebased, periodic, abs_2);
+}
+
+void perturb_row(struct reference_orbit *ref, int skip, floatexp dc_x0,
+        floatexp dx, floatexp dc_y, int n, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits, struct escape_stats *stats)
+{
+    long rebased = 0;
+    bool use_floatexp = dx.e < SPACING_DOUBLE_EXP;
+    double x0 = fe_to_d(dc_x0), step = fe_to_d(dx), y = fe_to_d(dc_y);
+    /* Below double range this is 0, and only exact cycles are caught */
+    double eps = fe_to_d(fe_mul_d(dx, PERIOD_TOLERANCE));
+    for (int i = 0; i < n; i++) {
+        bool pixel_rebased = false, periodic = false;
+        double abs_2;
+        struct orbit o;
+        if (orbits != NULL && !orbit_pending(orbits + i, iters + i, max_iter))
+            continue;
+        if (orbits != NULL && orbits[i].m >= 0) {
+            /* Carry on where max_iter stopped the pixel */
+            double dc_real = use_floatexp ? fe_to_d(fe_add(dc_x0,
+                        fe_mul_d(dx, i))) : x0 + i * step;
+            o = orbits[i];
+            iters[i] = perturb_iterate(ref, &o, iters[i], dc_real, y,
+                    max_iter, eps, &pixel_rebased, &periodic, &abs_2);
+        } else if (use_floatexp) {
+            iters[i] = perturb_point_fe(ref, skip,
+                    fe_add(dc_x0, fe_mul_d(dx, i)), dc_y, max_iter, eps,
+                    &pixel_rebased, &periodic, &abs_2, &o);
+        } else {
+            iters[i] = perturb_point(ref, skip, x0 + i * step, y, max_iter,
+                    eps, &pixel_rebased, &periodic, &abs_2, &o);
+        }
+        if (escaped_abs_2 != NULL && iters[i] < max_iter)
+            escaped_abs_2[i] = abs_2;
+        if (orbits != NULL)
+            orbits[i] = iters[i] < max_iter || periodic ? (struct orbit) {
+                .m = orbit_ended(iters[i], max_iter, periodic)} : o;
+        rebased += pixel_rebased;
+        stats->periodic += periodic;
+    }
+    if (rebased)
+        atomic_fetch_add(&ref->rebased, rebased);
+    if (skip > 1)
+        atomic_fetch_add(&ref->skipped, (long) n * (skip - 1));
+}
@@ -0,0 +1,69 @@
+#ifndef __PERTURBATION_H
+#define __PERTURBATION_H
+
+#include <stdatomic.h>
+#include <mpfr.h>
+
+#include "floatexp.h"
+
+struct orbit;
+struct escape_stats;
+
+/* A high-precision orbit Z_0 = 0, Z_{n+1} = Z_n^2 + C of one reference point,
+ * rounded to doubles. Pixels near C are iterated as a double-precision delta
+ * dz against it:
+ *     z_n = Z_n + dz_n,  dz_{n+1} = 2*Z_n*dz_n + dz_n^2 + dc
+ * where dc = c - C is the pixel's offset from the reference.
+ *
+ * An orbit is shared by every tile of a frame and released by whichever
+ * tile lets go of it last, to be kept for the next frame's orbit. The frame's pixel grid is stored with it as
+ * floatexps, since at depths past 1e-300 dc doesn't fit in a double: pixel
+ * (px, py) of the surface is at dc = (x + px*dx) + (y + py*dy)*I. */
+struct reference_orbit {
+    atomic_int refs;
+    int length;             /* Z_0 .. Z_{length-1} are stored, all bounded */
+    int capacity;           /* The arrays' size */
+    double *z_real, *z_imag;
+    struct series_term *series;
+    mpfr_t c_real, c_imag;  /* The reference point C */
+    mpfr_t work[5];         /* reference_orbit_compute()'s temporaries */
+    floatexp x, y, dx, dy;  /* Pixel grid relative to C */
+    atomic_long rebased;    /* Pixels that had to be rebased this frame */
+    atomic_long skipped;    /* Iterations skipped by series approximation */
+};
+
+/* Series approximation of the delta after n iterations of the reference:
+ *     dz_n ~= A_n*dc + B_n*dc^2 + C_n*dc^3
+ * The coefficients only depend on the reference orbit, so a whole tile can
+ * start its pixels at iteration n instead of 1. `radius` is the largest |dc|
+ * for which the truncated series is trusted at this n; it never grows with
+ * n, so the furthest usable n for a tile can be found by bisection. */
+struct series_term {
+    double a_real, a_imag;
+    double b_real, b_imag;
+    double c_real, c_imag;
+    double radius;
+};
+
+struct reference_orbit *reference_orbit_compute(mpfr_t c_real, mpfr_t c_imag,
+        int max_iter, long precision);
+void reference_orbit_retain(struct reference_orbit *ref);
+void reference_orbit_release(struct reference_orbit *ref);
+
+/* The reference iteration every pixel within `radius` of the reference point
+ * can jump to by series approximation (1 means no skipping). */
+int reference_orbit_skip(const struct reference_orbit *ref, floatexp radius,
+        int max_iter);
+
+/* Iteration counts of `n` pixels along a row, pixel i being at
+ * dc = (dc_x0 + i*dx) + dc_y*I relative to the reference point. Counts,
+ * escaped_abs_2 and orbits match the escape-time convention of escape_row();
+ * a kept orbit is the delta against the reference index in its m, so it can
+ * only be carried on against the same reference. New pixels start at
+ * reference iteration `skip`, as returned by reference_orbit_skip().
+ * Orbits found periodic are counted in `stats`. */
+void perturb_row(struct reference_orbit *ref, int skip, floatexp dc_x0,
+        floatexp dx, floatexp dc_y, int n, int max_iter, int *iters,
+        float *escaped_abs_2, struct orbit *orbits, struct escape_stats *stats);
+
+#endif
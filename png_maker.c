@@ -1,85 +1,432 @@
-#include <png.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <zlib.h>
 #include "png_maker.h"
+#include "tpool.h"
+
+/* Bands are cut to about PNG_BAND_BYTES of filtered rows each, in whole
+ * rows. Each is primed with up to PNG_WINDOW bytes of the band before,
+ * deflate's whole window, so cutting costs next to nothing in size. */
+#define PNG_BAND_BYTES (256 * 1024)
+#define PNG_WINDOW 32768
+
+/* A band of a png_stream's rows */
+struct png_band {
+    struct png_stream *stream;
+    int index;
+    atomic_long pending;  /* Pixels of its rows not final yet */
+    atomic_bool started;  /* Its encoding has been queued or done */
+    bool encoded;  /* Under the stream's mtx */
+    bool failed;  /* zlib gave an error encoding it */
+    /* Its part of the zlib stream, the header first in the first band and
+     * room for the checksum after it in the last */
+    uint8_t *data;
+    size_t n, size;
+    unsigned long adler;  /* Of its filtered rows */
+    long raw_n;
+};
+
+/* A filtering task's rows: row y unpacked, row y - 1, zeros for the row
+ * above the first, and the candidates of each filter, filter byte first */
+struct row_scratch {
+    uint8_t *rgb, *above, *zero, *out;
+    int above_y;  /* Which row `above` holds, or -1 */
+};
+
+static const char *row_filter_names[ROW_FILTERS] = {
+    "none", "sub", "up", "average", "paeth", "adaptive",
+};
+
+const char *row_filter_name(enum row_filter filter)
+{ return row_filter_names[filter]; }
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void chunk_write(struct png_stream *s, const char *type,
+        const uint8_t *data, size_t n)
+{
+    uint8_t word[4];
+    uLong crc = crc32(0, (const Bytef *) type, 4);
+    /* With no data, crc32() would start again */
+    if (n > 0)
+        crc = crc32(crc, data, n);
+    put_u32(word, n);
+    s->failed |= fwrite(word, 1, 4, s->fp) != 4;
+    s->failed |= fwrite(type, 1, 4, s->fp) != 4;
+    s->failed |= n > 0 && fwrite(data, 1, n, s->fp) != n;
+    put_u32(word, crc);
+    s->failed |= fwrite(word, 1, 4, s->fp) != 4;
+    s->out_bytes += 12 + n;
+}
 
-pixel_t * pixel_at(bitmap_t *bitmap, int x, int y) {
-    return bitmap->pixels + bitmap->width * y + x;
+static void row_unpack(const struct png_stream *s, int y, uint8_t *rgb)
+{
+    const uint32_t *row = (const uint32_t *) (s->pixels + y * s->pitch);
+    for (int x = 0; x < s->width; x++) {
+        rgb[3*x] = row[x] >> 16;
+        rgb[3*x + 1] = row[x] >> 8;
+        rgb[3*x + 2] = row[x];
+    }
 }
 
-int save_png_to_file(bitmap_t *bitmap, const char *path) {
-    FILE * fp;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    size_t x, y;
-    png_byte ** row_pointers = NULL;
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
 
-    int status = -1;
+/* Filter `n` bytes of `row` with `filter` into out, after the filter byte.
+ * The first pixel has no left neighbour, and a, b and c are taken as 0. */
+static void filter_row(enum row_filter filter, const uint8_t *row,
+        const uint8_t *above, int n, uint8_t *out)
+{
+    out[0] = filter;
+    out++;
+    switch (filter) {
+        case ROW_FILTER_NONE:
+            memcpy(out, row, n);
+            break;
+        case ROW_FILTER_SUB:
+            memcpy(out, row, 3);
+            for (int i = 3; i < n; i++)
+                out[i] = row[i] - row[i-3];
+            break;
+        case ROW_FILTER_UP:
+            for (int i = 0; i < n; i++)
+                out[i] = row[i] - above[i];
+            break;
+        case ROW_FILTER_AVERAGE:
+            for (int i = 0; i < 3; i++)
+                out[i] = row[i] - above[i] / 2;
+            for (int i = 3; i < n; i++)
+                out[i] = row[i] - (row[i-3] + above[i]) / 2;
+            break;
+        case ROW_FILTER_PAETH:
+            for (int i = 0; i < 3; i++)
+                out[i] = row[i] - above[i];
+            for (int i = 3; i < n; i++)
+                out[i] = row[i] - paeth(row[i-3], above[i], above[i-3]);
+            break;
+        default:
+            break;
+    }
+}
 
-    int pixel_size = 3;
-    int depth = 8;
+/* The sum of a filtered row as signed bytes, by which ROW_FILTER_ADAPTIVE
+ * picks a filter, as libpng does */
+static long filtered_sum(const uint8_t *out, int n)
+{
+    long sum = 0;
+    for (int i = 1; i <= n; i++)
+        sum += out[i] < 128 ? out[i] : 256 - out[i];
+    return sum;
+}
 
-    fp = fopen(path, "wb");
-    if (! fp) {
-        goto fopen_failed;
+/* Row y of the image filtered with the stream's filter, filter byte first */
+static const uint8_t *row_filtered(const struct png_stream *s,
+        struct row_scratch *r, int y)
+{
+    int n = 3 * s->width;
+    if (y > 0 && r->above_y != y - 1)
+        row_unpack(s, y - 1, r->above);
+    row_unpack(s, y, r->rgb);
+    const uint8_t *above = y > 0 ? r->above : r->zero;
+    const uint8_t *best = r->out;
+    if (s->filter != ROW_FILTER_ADAPTIVE) {
+        filter_row(s->filter, r->rgb, above, n, r->out);
+    } else {
+        long best_sum = -1;
+        for (int f = ROW_FILTER_NONE; f < ROW_FILTER_ADAPTIVE; f++) {
+            uint8_t *out = r->out + f * (n + 1);
+            filter_row(f, r->rgb, above, n, out);
+            long sum = filtered_sum(out, n);
+            if (best_sum < 0 || sum < best_sum) {
+                best = out;
+                best_sum = sum;
+            }
+        }
     }
+    /* Row y is above the next */
+    uint8_t *t = r->above;
+    r->above = r->rgb;
+    r->rgb = t;
+    r->above_y = y;
+    return best;
+}
 
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png_ptr == NULL) {
-        goto png_create_write_struct_failed;
+/* Deflate `n` bytes into the band, growing its buffer as needed. Returns
+ * deflate()'s last result; Z_BUF_ERROR only means a call had nothing to do. */
+static int band_deflate(struct png_band *b, z_stream *z, const uint8_t *in,
+        size_t n, int flush)
+{
+    int ret;
+    z->next_in = (Bytef *) in;
+    z->avail_in = n;
+    while (true) {
+        if (b->n == b->size) {
+            b->size *= 2;
+            b->data = realloc(b->data, b->size);
+        }
+        z->next_out = b->data + b->n;
+        z->avail_out = b->size - b->n;
+        ret = deflate(z, flush);
+        b->n = b->size - z->avail_out;
+        if (z->avail_out > 0 || ret == Z_STREAM_ERROR)
+            return ret;
     }
+}
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL) {
-        goto png_create_info_struct_failed;
+/* Write band b, the next in order, to the file */
+static void band_write(struct png_stream *s, struct png_band *b)
+{
+    s->failed |= b->failed;
+    s->adler = adler32_combine(s->adler, b->adler, b->raw_n);
+    if (b->index == s->n_bands - 1) {
+        put_u32(b->data + b->n, s->adler);
+        b->n += 4;
     }
+    chunk_write(s, "IDAT", b->data, b->n);
+    free(b->data);
+    b->data = NULL;
+}
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        goto png_failure;
+static void *band_encode(void *arguments)
+{
+    struct png_band *b = arguments;
+    struct png_stream *s = b->stream;
+    struct timespec start, end;
+    struct row_scratch r;
+    z_stream z = {0};
+    int n = 3 * s->width;
+    int y0 = b->index * s->band_rows;
+    int y1 = y0 + s->band_rows < s->height ? y0 + s->band_rows : s->height;
+    bool last = b->index == s->n_bands - 1;
+    /* CPU time, so that workers sharing a CPU don't count each other's */
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    r.rgb = malloc(n);
+    r.above = malloc(n);
+    r.zero = calloc(n, 1);
+    r.out = malloc((ROW_FILTERS - 1) * (n + 1));
+    r.above_y = -1;
+    b->failed = deflateInit2(&z, s->level, Z_DEFLATED, -15, 8,
+            s->filter == ROW_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED)
+        != Z_OK;
+    if (!b->failed && y0 > 0 && s->band_rows > 1) {
+        /* The end of the band before, filtered again. The decoder reads
+         * back into it, so it must be exactly that: rows of that band
+         * whose row above is in it too, as only it is sure to be final. */
+        int rows = (PNG_WINDOW + n) / (n + 1);
+        rows = rows < s->band_rows - 1 ? rows : s->band_rows - 1;
+        uint8_t *dict = malloc((size_t) rows * (n + 1));
+        for (int i = 0; i < rows; i++)
+            memcpy(dict + (size_t) i * (n + 1),
+                    row_filtered(s, &r, y0 - rows + i), n + 1);
+        size_t dict_n = (size_t) rows * (n + 1);
+        size_t used = dict_n < PNG_WINDOW ? dict_n : PNG_WINDOW;
+        b->failed = deflateSetDictionary(&z, dict + dict_n - used, used)
+            != Z_OK;
+        free(dict);
     }
 
-    png_set_IHDR    (
-                png_ptr,
-                info_ptr,
-                bitmap->width,
-                bitmap->height,
-                depth,
-                PNG_COLOR_TYPE_RGB,
-                PNG_INTERLACE_NONE,
-                PNG_COMPRESSION_TYPE_DEFAULT,
-                PNG_FILTER_TYPE_DEFAULT
-            );
-    row_pointers = png_malloc(png_ptr, bitmap->height * sizeof(png_byte *));
-    for (y = 0; y < bitmap->height; y++) {
-        png_byte *row = png_malloc(png_ptr, sizeof(uint8_t) * bitmap->width * pixel_size);
-        row_pointers[y] = row;
-        for (x = 0; x < bitmap->width; x++) {
-            pixel_t * pixel = pixel_at(bitmap, x, y);
-            *row++ = pixel->red;
-            *row++ = pixel->green;
-            *row++ = pixel->blue;
+    b->raw_n = (long) (y1 - y0) * (n + 1);
+    /* With room for the zlib header, sync flush and checksum */
+    b->size = deflateBound(&z, b->raw_n) + 16;
+    b->data = malloc(b->size);
+    b->n = 0;
+    if (b->index == 0) {
+        /* Deflate, 32K window, and the level, as zlib writes it */
+        int level = s->level < 2 ? 0 : s->level < 6 ? 1 : s->level == 6 ? 2 : 3;
+        b->data[0] = 0x78;
+        b->data[1] = level << 6;
+        b->data[1] += 31 - (0x78 * 256 + b->data[1]) % 31;
+        b->n = 2;
+    }
+    b->adler = adler32(0, NULL, 0);
+    for (int y = y0; y < y1 && !b->failed; y++) {
+        const uint8_t *row = row_filtered(s, &r, y);
+        b->adler = adler32(b->adler, row, n + 1);
+        b->failed = band_deflate(b, &z, row, n + 1, Z_NO_FLUSH)
+            == Z_STREAM_ERROR;
+    }
+    if (!b->failed) {
+        int ret = band_deflate(b, &z, NULL, 0, last ? Z_FINISH
+                : Z_SYNC_FLUSH);
+        b->failed = last ? ret != Z_STREAM_END : ret == Z_STREAM_ERROR;
+    }
+    deflateEnd(&z);
+    if (last && b->size - b->n < 4) {
+        b->size = b->n + 4;
+        b->data = realloc(b->data, b->size);
+    }
+    free(r.rgb);
+    free(r.above);
+    free(r.zero);
+    free(r.out);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    atomic_fetch_add(&s->encode_nanos, (end.tv_sec - start.tv_sec)
+            * 1000000000L + end.tv_nsec - start.tv_nsec);
+
+    pthread_mutex_lock(&s->mtx);
+    b->encoded = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mtx);
+    return NULL;
+}
+
+/* Queue band i's encoding if its rows and the band above are final and it
+ * hasn't been already */
+static void band_try_start(struct png_stream *s, int i)
+{
+    if (s->q == NULL || i >= s->n_bands
+            || atomic_load(&s->bands[i].pending) > 0
+            || (i > 0 && atomic_load(&s->bands[i-1].pending) > 0)
+            || atomic_exchange(&s->bands[i].started, true))
+        return;
+    queue_add(s->q, band_encode, &s->bands[i]);
+}
+
+struct png_stream *png_stream_open(const char *path, int width, int height,
+        const void *pixels, long pitch, int level, enum row_filter filter,
+        struct queue *q)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n',
+        0x1A, '\n'};
+    uint8_t ihdr[13] = {0};
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+        return NULL;
+    struct png_stream *s = malloc(sizeof(struct png_stream));
+    long row_bytes = 3L * width + 1;
+    s->fp = fp;
+    s->width = width;
+    s->height = height;
+    s->pixels = pixels;
+    s->pitch = pitch;
+    s->level = level;
+    s->filter = filter;
+    s->q = q;
+    s->band_rows = PNG_BAND_BYTES / row_bytes > 0
+        ? PNG_BAND_BYTES / row_bytes : 1;
+    s->n_bands = (height + s->band_rows - 1) / s->band_rows;
+    s->bands = calloc(s->n_bands, sizeof(struct png_band));
+    for (int i = 0; i < s->n_bands; i++) {
+        struct png_band *b = &s->bands[i];
+        int rows = height - i * s->band_rows;
+        b->stream = s;
+        b->index = i;
+        atomic_init(&b->pending, (long) width
+                * (rows < s->band_rows ? rows : s->band_rows));
+        atomic_init(&b->started, false);
+    }
+    atomic_init(&s->final_bands, 0);
+    pthread_mutex_init(&s->mtx, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->idle = false;
+    s->next_write = 0;
+    s->adler = adler32(0, NULL, 0);
+    s->out_bytes = sizeof(signature);
+    s->failed = fwrite(signature, 1, sizeof(signature), fp)
+        != sizeof(signature);
+    atomic_init(&s->encode_nanos, 0);
+
+    /* 8-bit RGB, not interlaced */
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+    chunk_write(s, "IHDR", ihdr, sizeof(ihdr));
+    return s;
+}
+
+void png_stream_done(struct png_stream *s, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0)
+        return;
+    for (int i = y / s->band_rows; i < s->n_bands
+            && i * s->band_rows < y + h; i++) {
+        int y0 = i * s->band_rows > y ? i * s->band_rows : y;
+        int y1 = (i + 1) * s->band_rows < y + h ? (i + 1) * s->band_rows
+            : y + h;
+        long done = (long) w * (y1 - y0);
+        if (atomic_fetch_sub(&s->bands[i].pending, done) != done)
+            continue;
+        /* It may be the last the band below was waiting for */
+        band_try_start(s, i);
+        band_try_start(s, i + 1);
+        if (atomic_fetch_add(&s->final_bands, 1) + 1 == s->n_bands)
+            clock_gettime(CLOCK_MONOTONIC, &s->rows_final);
+    }
+}
+
+void png_stream_write(struct png_stream *s)
+{
+    pthread_mutex_lock(&s->mtx);
+    while (s->next_write < s->n_bands) {
+        struct png_band *b = &s->bands[s->next_write];
+        if (!b->encoded && !s->idle) {
+            pthread_cond_wait(&s->cond, &s->mtx);
+            continue;
         }
+        if (!b->encoded)
+            break;
+        /* Only this thread writes, so the file needs no lock */
+        s->next_write++;
+        pthread_mutex_unlock(&s->mtx);
+        band_write(s, b);
+        pthread_mutex_lock(&s->mtx);
     }
+    pthread_mutex_unlock(&s->mtx);
+}
 
-    png_init_io(png_ptr, fp);
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-    // We have successfully written the png.
-    status = 0;
+void png_stream_idle(struct png_stream *s)
+{
+    pthread_mutex_lock(&s->mtx);
+    s->idle = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mtx);
+}
 
-    for (y = 0; y < bitmap->height; y++) {
-        png_free(png_ptr, row_pointers[y]);
+int png_stream_close(struct png_stream *s, struct png_stream_stats *stats)
+{
+    struct timespec end;
+    if (atomic_load(&s->final_bands) < s->n_bands)
+        clock_gettime(CLOCK_MONOTONIC, &s->rows_final);
+    for (int i = 0; i < s->n_bands; i++)
+        if (!atomic_exchange(&s->bands[i].started, true))
+            band_encode(&s->bands[i]);
+    png_stream_idle(s);
+    png_stream_write(s);
+    chunk_write(s, "IEND", NULL, 0);
+    s->failed |= fclose(s->fp) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (stats != NULL) {
+        stats->n_bands = s->n_bands;
+        stats->band_rows = s->band_rows;
+        stats->raw_bytes = (3L * s->width + 1) * s->height;
+        stats->out_bytes = s->out_bytes;
+        stats->encode_nanos = atomic_load(&s->encode_nanos);
+        stats->tail_nanos = (end.tv_sec - s->rows_final.tv_sec) * 1000000000L
+            + end.tv_nsec - s->rows_final.tv_nsec;
     }
-    png_free(png_ptr, row_pointers);
-
-    png_failure:
-    png_create_info_struct_failed:
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-    png_create_write_struct_failed:
-        fclose(fp);
-    fopen_failed:
-        return status;
+    bool failed = s->failed;
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->mtx);
+    free(s->bands);
+    free(s);
+    return failed ? -1 : 0;
 }
 
 int pix(int value, int max) {
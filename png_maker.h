@@ -1,10 +1,14 @@
 #ifndef __PNG_MAKER_H
 #define __PNG_MAKER_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 
 /*********************************************************************************************/
 // This code was taken from "https://www.programmingalgorithms.com/algorithm/hsv-to-rgb?lang=C"
@@ -24,19 +28,82 @@ struct HSV
 /*********************************************************************************************/
 
 struct RGB HSVToRGB(struct HSV hsv);
-typedef struct  {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-} pixel_t;
-
-typedef struct {
-    pixel_t *pixels;
-    size_t width;
-    size_t height;
-} bitmap_t;
-// Put functions here.
-pixel_t * pixel_at(bitmap_t *bitmap, int x, int y);
-int save_png_to_file(bitmap_t *bitmap, const char *path);
+
+struct queue;
+
+/* How each row is filtered before it is compressed */
+enum row_filter {
+    ROW_FILTER_NONE,
+    ROW_FILTER_SUB,
+    ROW_FILTER_UP,
+    ROW_FILTER_AVERAGE,
+    ROW_FILTER_PAETH,
+    ROW_FILTER_ADAPTIVE,  /* Whichever of those leaves the smallest sum */
+};
+#define ROW_FILTERS 6
+
+struct png_band;
+
+/* An RGB PNG written from rows of packed 0xRRGGBB pixels, `pitch` bytes
+ * apart, while they are still being drawn. The rows are cut into bands,
+ * each filtered and deflated by a task on q as soon as its rows and the row
+ * above are final, and written by png_stream_write() as an IDAT chunk of
+ * its own, so the tasks never wait on the file. A band starts
+ * its deflate stream primed with the end of the band before, and ends it
+ * with a sync flush, so the chunks join into one zlib stream. Only a band's
+ * compressed data is ever copied. */
+struct png_stream {
+    FILE *fp;
+    int width, height;
+    const uint8_t *pixels;
+    long pitch;
+    int level;  /* zlib's, 0-9 */
+    enum row_filter filter;
+    struct queue *q;
+    int band_rows, n_bands;
+    struct png_band *bands;
+    atomic_int final_bands;  /* Bands whose rows are all final */
+    struct timespec rows_final;  /* When the last of them was */
+    /* Tasks mark their band encoded and signal cond, under mtx, for the
+     * writing thread, which is told by idle that no more are coming */
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool idle;
+    /* Only the writing thread's */
+    int next_write;
+    unsigned long adler;  /* Of the bands written so far */
+    long out_bytes;
+    bool failed;
+    atomic_long encode_nanos;
+};
+
+struct png_stream_stats {
+    int n_bands, band_rows;
+    long raw_bytes;  /* Filtered rows, before compression */
+    long out_bytes;  /* The whole file */
+    /* CPU time spent filtering and deflating, summed over the tasks, and
+     * the time from the last row being final to the file being closed */
+    long encode_nanos, tail_nanos;
+};
+
+/* Start writing the file, or return NULL if it can't be opened. Without a
+ * queue, every band is encoded by png_stream_close(). */
+struct png_stream *png_stream_open(const char *path, int width, int height,
+        const void *pixels, long pitch, int level, enum row_filter filter,
+        struct queue *q);
+/* Note that `w` pixels of each of rows y..y+h-1 are final. Every pixel is
+ * to be counted once. From any thread. */
+void png_stream_done(struct png_stream *s, int y, int w, int h);
+/* Write the bands out in order as the tasks encode them, blocking until all
+ * are written or png_stream_idle() is called. Only ever from one thread. */
+void png_stream_write(struct png_stream *s);
+/* Note that no more bands will be encoded by tasks, e.g. once their group
+ * is finished, so png_stream_write() returns. From any thread. */
+void png_stream_idle(struct png_stream *s);
+/* Encode whatever bands haven't been and finish the file, from the thread
+ * that writes it. Call once every row is final and the tasks encoding them
+ * have returned. Returns 0, or -1 if the file couldn't be written. */
+int png_stream_close(struct png_stream *s, struct png_stream_stats *stats);
+const char *row_filter_name(enum row_filter filter);
 
 #endif /* png_maker_h */
@@ -1,25 +1,17 @@
+#include <limits.h>
+#include <string.h>
+
 #include "sdl_window.h"
 
-struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
-        int w_w, int w_h, int max_iter, void *(*func)(void*))
+/* Everything but the window and its surface: the view, the buffers and the
+ * render state. Tiles push wake_event when they change the surface, unless
+ * it is (Uint32) -1. */
+static struct sdl_window_info window_state_init(double x, double y,
+        double w, double h, int w_w, int w_h, int max_iter,
+        void *(*func)(void*), Uint32 wake_event)
 {
     struct sdl_window_info ret;
 
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        fprintf(stderr, "ERROR: Failed to initialise the SDL2 library\n");
-        exit(EXIT_FAILURE);
-    }
-    ret.win = SDL_CreateWindow("SDL window", SDL_WINDOWPOS_CENTERED,
-            SDL_WINDOWPOS_CENTERED, w_w, w_h, 0);
-    if (ret.win == NULL) {
-        fprintf(stderr, "ERROR: failed to create window\n");
-        exit(EXIT_FAILURE);
-    }
-    ret.surf = SDL_GetWindowSurface(ret.win);
-    if (ret.surf == NULL) {
-        fprintf(stderr, "ERROR: failed to get surface from the window\n");
-        exit(EXIT_FAILURE);
-    }
     ret.keep_open = true;
     ret.v.view = (SDL_Rect) {.x=0, .y=0, .w=w_w, .h=w_h};
     ret.v.use_high_precision = false;
@@ -30,7 +22,8 @@ struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
     ret.v.w = w;
     ret.v.h = h;
     ret.mv_pct = 0.1;
-    ret.zoom_pct = 0.6;
+    /* Zooming by powers of two keeps a quarter of the pixels */
+    ret.zoom_pct = 0.5;
     /* Initialise the high-precision values */
 //    mpfr_init2(ret.v.x_hp, 200);
 //    mpfr_init2(ret.v.y_hp, 200);
@@ -42,6 +35,25 @@ struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
 //    mpfr_set_d(ret.v.h_hp, h, MPFR_RNDN);
     ret.max_iter = max_iter;
     ret.func = func;
+    ret.use_perturbation = true;
+    ret.use_boundary_trace = false;
+    ret.use_progressive = true;
+    ret.tile_order = TILE_ORDER_CENTRE;
+    ret.iters = calloc(w_w * w_h, sizeof(int));
+    ret.escaped_abs_2 = calloc(w_w * w_h, sizeof(float));
+    ret.orbits = calloc(w_w * w_h, sizeof(struct orbit));
+    ret.preview = NULL;
+    ret.zoom_source = malloc(sizeof(int) * (w_w + w_h));
+    ret.render = malloc(sizeof(struct render_state));
+    atomic_init(&ret.render->generation, 0);
+    task_group_init(&ret.render->tasks, NULL, NULL);
+    atomic_init(&ret.render->cut_short, false);
+    pthread_mutex_init(&ret.render->damage.mtx, NULL);
+    ret.render->damage.n = 0;
+    ret.render->damage.wake_event = wake_event;
+    ret.render->damage.wake_sent = false;
+    ret.render->png = NULL;
+    ret.colouring = (struct colouring) {.hue_offset = 0, .smooth = false};
 
     ret._default_keep_open = ret.keep_open;
     ret._default_v = ret.v;
@@ -50,6 +62,63 @@ struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
     return ret;
 }
 
+struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
+        int w_w, int w_h, int max_iter, void *(*func)(void*))
+{
+    struct sdl_window_info ret;
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        fprintf(stderr, "ERROR: Failed to initialise the SDL2 library\n");
+        exit(EXIT_FAILURE);
+    }
+    ret = window_state_init(x, y, w, h, w_w, w_h, max_iter, func,
+            SDL_RegisterEvents(1));
+    ret.win = SDL_CreateWindow("SDL window", SDL_WINDOWPOS_CENTERED,
+            SDL_WINDOWPOS_CENTERED, w_w, w_h, 0);
+    if (ret.win == NULL) {
+        fprintf(stderr, "ERROR: failed to create window\n");
+        exit(EXIT_FAILURE);
+    }
+    ret.surf = SDL_GetWindowSurface(ret.win);
+    if (ret.surf == NULL) {
+        fprintf(stderr, "ERROR: failed to get surface from the window\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+struct sdl_window_info sdl_headless_init(double x, double y, double w,
+        double h, int w_w, int w_h, int max_iter, void *(*func)(void*))
+{
+    struct sdl_window_info ret = window_state_init(x, y, w, h, w_w, w_h,
+            max_iter, func, (Uint32) -1);
+    ret.win = NULL;
+    /* A plain surface is only memory, and needs no SDL_Init() */
+    ret.surf = SDL_CreateRGBSurface(0, w_w, w_h, 32, 0, 0, 0, 0);
+    if (ret.surf == NULL) {
+        fprintf(stderr, "ERROR: failed to create a %dx%d surface\n", w_w, w_h);
+        exit(EXIT_FAILURE);
+    }
+    /* Nobody watches the coarse passes */
+    ret.use_progressive = false;
+    return ret;
+}
+
+void sdl_headless_free(struct sdl_window_info *win)
+{
+    if (win->v.use_high_precision)
+        mpfr_clears(win->v.x_hp, win->v.y_hp, win->v.w_hp, win->v.h_hp, NULL);
+    SDL_FreeSurface(win->surf);
+    free(win->iters);
+    free(win->escaped_abs_2);
+    free(win->orbits);
+    SDL_FreeSurface(win->preview);
+    free(win->zoom_source);
+    task_group_destroy(&win->render->tasks);
+    pthread_mutex_destroy(&win->render->damage.mtx);
+    free(win->render);
+}
+
 void my_sdl_reset(struct sdl_window_info *win)
 {
     win->keep_open = win->_default_keep_open;
@@ -71,11 +140,99 @@ void sdl_blank_screen(struct sdl_window_info win, SDL_Rect blank_area)
     SDL_FreeSurface(new_surface);
 }
 
+void sdl_damage(struct render_state *render, SDL_Rect rect)
+{
+    struct damage *d = &render->damage;
+    if (rect.w <= 0 || rect.h <= 0)
+        return;
+    pthread_mutex_lock(&d->mtx);
+    if (d->n < DAMAGE_MAX_RECTS) {
+        d->rects[d->n++] = rect;
+    } else {
+        /* Take it into whichever rectangle that grows the least */
+        int best = 0;
+        long best_growth = LONG_MAX;
+        for (int i = 0; i < d->n; i++) {
+            SDL_Rect u;
+            SDL_UnionRect(&d->rects[i], &rect, &u);
+            long growth = (long) u.w * u.h
+                - (long) d->rects[i].w * d->rects[i].h;
+            if (growth < best_growth) {
+                best = i;
+                best_growth = growth;
+            }
+        }
+        SDL_Rect u;
+        SDL_UnionRect(&d->rects[best], &rect, &u);
+        d->rects[best] = u;
+    }
+    bool wake = !d->wake_sent && d->wake_event != (Uint32) -1;
+    d->wake_sent = true;
+    pthread_mutex_unlock(&d->mtx);
+    if (wake) {
+        SDL_Event e = {.type = d->wake_event};
+        SDL_PushEvent(&e);
+    }
+}
+
+bool sdl_damaged(struct sdl_window_info win)
+{
+    struct damage *d = &win.render->damage;
+    pthread_mutex_lock(&d->mtx);
+    bool damaged = d->n > 0;
+    pthread_mutex_unlock(&d->mtx);
+    return damaged;
+}
+
+void sdl_present(struct sdl_window_info win)
+{
+    struct damage *d = &win.render->damage;
+    SDL_Rect rects[DAMAGE_MAX_RECTS];
+    pthread_mutex_lock(&d->mtx);
+    int n = d->n;
+    memcpy(rects, d->rects, sizeof(SDL_Rect) * n);
+    d->n = 0;
+    d->wake_sent = false;
+    pthread_mutex_unlock(&d->mtx);
+    if (n > 0)
+        SDL_UpdateWindowSurfaceRects(win.win, rects, n);
+}
+
+/* Move the iteration buffer's counts in `from` to `to`, as the surface's
+ * pixels are blitted. Perturbed orbits are kept relative to a reference at
+ * the centre of the view, which moves, so in high precision kept orbits
+ * have to start again. */
+static void viewport_buffer_move(struct sdl_window_info *win, SDL_Rect from,
+        SDL_Rect to)
+{
+    int stride = win->v.view.w;
+    /* Go against the direction of the move so rows aren't overwritten
+     * before they are copied */
+    bool down = to.y > from.y;
+    for (int i = 0; i < from.h; i++) {
+        int row = down ? from.h - 1 - i : i;
+        memmove(win->iters + (to.y + row)*stride + to.x,
+                win->iters + (from.y + row)*stride + from.x,
+                from.w * sizeof(int));
+        memmove(win->escaped_abs_2 + (to.y + row)*stride + to.x,
+                win->escaped_abs_2 + (from.y + row)*stride + from.x,
+                from.w * sizeof(float));
+        struct orbit *orbits = win->orbits + (to.y + row)*stride + to.x;
+        memmove(orbits, win->orbits + (from.y + row)*stride + from.x,
+                from.w * sizeof(struct orbit));
+        for (int col = 0; col < from.w; col++)
+            if (win->v.use_high_precision && orbits[col].m >= 0)
+                orbits[col].m = ORBIT_RESTART;
+    }
+}
+
 /* Move the viewport in a given direction.
  * Takes into account the mv_pct as the fraction of the viewport width/height
  * to move by.
- * Supports high_precision MPFR numbers. */
-void viewport_mv(struct sdl_window_info *win, enum MV_DIR dir, struct viewport_mapping *redraw_area)
+ * Supports high_precision MPFR numbers.
+ * The strip of the window that needs rendering afterwards is returned in
+ * redraw_area, and its pixels are set to be iterated from the start. */
+void viewport_mv(struct sdl_window_info *win, enum MV_DIR dir, SDL_Rect *redraw_area)
 {
     mpfr_t dx_hp, dy_hp;
     double dx = 0, dy = 0;
@@ -174,50 +331,171 @@ void viewport_mv(struct sdl_window_info *win, enum MV_DIR dir, struct viewport_m
         win->v.x += dx;
         win->v.y += dy;
     }
-    if (redraw_area != NULL) {
-        redraw_area->view = discard_area;
-    }
     // Try a direct copy:
     SDL_BlitSurface(win->surf, &keep_area, win->surf, &dest_area);
+    viewport_buffer_move(win, keep_area, dest_area);
+    for (int py = discard_area.y; py < discard_area.y + discard_area.h; py++) {
+        for (int px = discard_area.x; px < discard_area.x + discard_area.w;
+                px++) {
+            win->iters[py*win->v.view.w + px] = 0;
+            win->orbits[py*win->v.view.w + px].m = ORBIT_RESTART;
+        }
+    }
     // If that doesn't work do it indirectly:
 //    SDL_Surface *temp_surf = SDL_CreateRGBSurface(0, keep_area.w,
 //            keep_area.h, win->surf->format->BitsPerPixel, 0, 0, 0, 0);
 //    SDL_BlitSurface(win->surf, &keep_area, temp_surf, NULL);
 //    SDL_BlitSurface(temp_surf, NULL, win->surf, &dest_area);
 //    SDL_FreeSurface(temp_surf);
-    if (redraw_area != NULL) {
-        *redraw_area = win->v;
-        redraw_area->view = discard_area;
-        if (win->v.use_high_precision) {
-            mpfr_inits2(win->v.precision, redraw_area->w_hp, redraw_area->h_hp,
-                    redraw_area->x_hp, redraw_area->y_hp, NULL);
-            mpfr_mul_d(redraw_area->w_hp, win->v.w_hp, redraw_area->view.w /
-                    (double) win->v.view.w, MPFR_RNDN);
-            mpfr_mul_d(redraw_area->h_hp, win->v.h_hp, redraw_area->view.h /
-                    (double) win->v.view.h, MPFR_RNDN);
-            mpfr_mul_d(redraw_area->x_hp, win->v.w_hp, discard_area.x / (double)
-                win->v.view.w, MPFR_RNDN);
-            mpfr_add(redraw_area->x_hp, redraw_area->x_hp, win->v.x_hp, MPFR_RNDN);
-            mpfr_mul_d(redraw_area->y_hp, win->v.h_hp, discard_area.y / (double)
-                win->v.view.h, MPFR_RNDN);
-            mpfr_add(redraw_area->y_hp, redraw_area->y_hp, win->v.y_hp, MPFR_RNDN);
-        } else {
-            redraw_area->w = win->v.w * redraw_area->view.w /
-                (double) win->v.view.w;
-            redraw_area->h = win->v.h * redraw_area->view.h /
-                (double) win->v.view.h;
-            redraw_area->x = win->v.x + win->v.w * (discard_area.x / (double)
-                win->v.view.w);
-            redraw_area->y = win->v.y + win->v.h * (discard_area.y / (double)
-                win->v.view.h);
+    if (redraw_area != NULL)
+        *redraw_area = discard_area;
+}
+
+int viewport_mirror(struct sdl_window_info win)
+{
+    double k;
+    /* k = -2*y/dy */
+    if (win.v.use_high_precision) {
+        mpfr_t tmp;
+        mpfr_init2(tmp, win.v.precision);
+        mpfr_mul_si(tmp, win.v.y_hp, -2 * win.v.view.h, MPFR_RNDN);
+        mpfr_div(tmp, tmp, win.v.h_hp, MPFR_RNDN);
+        k = mpfr_get_d(tmp, MPFR_RNDN);
+        mpfr_clear(tmp);
+    } else {
+        k = -2 * win.v.y * win.v.view.h / win.v.h;
+    }
+    if (k <= 0 || k >= 2 * win.v.view.h
+            || fabs(k - round(k)) > SYMMETRY_TOLERANCE)
+        return -1;
+    return round(k);
+}
+
+/* The precision that resolves the corner of a view `w` wide to a fraction of
+ * a pixel: 64 guard bits below the pixel spacing */
+static long width_precision(floatexp w)
+{
+    /* Coordinates are below 2^2 and a pixel is roughly w/2^11 wide */
+    return 2 - (w.e - 11) + 64;
+}
+
+/* Grow the precision of the high-precision coordinates as the view deepens,
+ * so the corner can still be resolved. The precision is never reduced. */
+static void viewport_fit_precision(struct sdl_window_info *win)
+{
+    long needed = width_precision(win->v.w_fe);
+    if (needed <= win->v.precision)
+        return;
+    win->v.precision = needed;
+    mpfr_prec_round(win->v.x_hp, needed, MPFR_RNDN);
+    mpfr_prec_round(win->v.y_hp, needed, MPFR_RNDN);
+    mpfr_prec_round(win->v.w_hp, needed, MPFR_RNDN);
+    mpfr_prec_round(win->v.h_hp, needed, MPFR_RNDN);
+}
+
+/* Show the old view scaled to the new one straight away, for the new frame
+ * to be rendered over. `scale` is the new width over the old. */
+static void viewport_zoom_preview(struct sdl_window_info *win, double scale)
+{
+    SDL_Rect all = win->v.view, from = all, to = all;
+    if (scale < 1) {
+        from.w = all.w * scale;
+        from.h = all.h * scale;
+        from.x = all.x + (all.w - from.w) / 2;
+        from.y = all.y + (all.h - from.h) / 2;
+    } else {
+        to.w = all.w / scale;
+        to.h = all.h / scale;
+        to.x = all.x + (all.w - to.w) / 2;
+        to.y = all.y + (all.h - to.h) / 2;
+    }
+    /* Scaled blits can't overlap, so go through a copy, the size of the
+     * window so that any zoom fits */
+    if (win->preview == NULL)
+        win->preview = SDL_CreateRGBSurface(0, all.w, all.h,
+                win->surf->format->BitsPerPixel, 0, 0, 0, 0);
+    SDL_Rect copy = {0, 0, from.w, from.h};
+    SDL_BlitSurface(win->surf, &from, win->preview, NULL);
+    if (scale > 1)
+        sdl_blank_screen(*win, all);
+    SDL_BlitScaled(win->preview, &copy, win->surf, &to);
+}
+
+/* The pixel of the old view whose sample point pixel p of the new one
+ * shares, along an axis of n pixels whose spacing was scaled by num/den
+ * about the centre, or -1 if there isn't one */
+static int zoom_source(int p, int n, int num, int den)
+{
+    if (p % den != 0)
+        return -1;
+    int o = n * (den - num) / (2 * den) + p / den * num;
+    return o >= 0 && o < n ? o : -1;
+}
+
+/* The i-th pixel along an axis of n pixels, in an order that moves them in
+ * place: from the centre out when zooming out, as each pixel's source is
+ * further out than itself, or from the edges in when zooming in. */
+static int zoom_order(int i, int n, bool outward)
+{
+    int c = n / 2;
+    if (outward)
+        return i < n - c ? c + i : c - 1 - (i - (n - c));
+    return i < c ? i : n - 1 - (i - c);
+}
+
+/* After the pixel spacing was scaled by num/den about the centre, with one
+ * of them 1 and the other a power of two, keep the iteration buffer of the
+ * pixels whose sample points are shared with the old view and set the rest
+ * to be iterated from the start. Only possible when the centre falls on a
+ * pixel of both grids. Perturbed orbits are relative to a reference that
+ * the zoom moves, so in high precision kept orbits have to start again.
+ * Returns whether any pixels were kept. */
+static bool viewport_buffer_zoom(struct sdl_window_info *win, int num,
+        int den, bool keep_z)
+{
+    int w = win->v.view.w, h = win->v.view.h;
+    if ((long) w * abs(den - num) % (2 * den) != 0
+            || (long) h * abs(den - num) % (2 * den) != 0)
+        return false;
+    int *source_x = win->zoom_source, *source_y = win->zoom_source + w;
+    for (int px = 0; px < w; px++)
+        source_x[px] = zoom_source(px, w, num, den);
+    for (int py = 0; py < h; py++)
+        source_y[py] = zoom_source(py, h, num, den);
+    for (int i = 0; i < h; i++) {
+        int py = zoom_order(i, h, num > den);
+        int oy = source_y[py];
+        if (oy < 0)
+            continue;
+        for (int j = 0; j < w; j++) {
+            int px = zoom_order(j, w, num > den);
+            int ox = source_x[px];
+            if (ox < 0)
+                continue;
+            win->iters[py*w + px] = win->iters[oy*w + ox];
+            win->escaped_abs_2[py*w + px] = win->escaped_abs_2[oy*w + ox];
+            win->orbits[py*w + px] = win->orbits[oy*w + ox];
+            if (!keep_z && win->orbits[py*w + px].m >= 0)
+                win->orbits[py*w + px].m = ORBIT_RESTART;
+        }
+    }
+    /* Only now, as pixels that aren't kept may have been sources */
+    for (int py = 0; py < h; py++) {
+        for (int px = 0; px < w; px++) {
+            if (source_y[py] >= 0 && source_x[px] >= 0)
+                continue;
+            win->iters[py*w + px] = 0;
+            win->orbits[py*w + px].m = ORBIT_RESTART;
         }
     }
+    return true;
 }
 
-void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
+bool viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
 {
-    double cx, cy, scale;
+    double cx, cy, scale, scale_in;
     bool high_precision = win->v.use_high_precision;
+    int exp;
     switch (dir) {
         case ZOOM_IN:
             /* Zoom in: w,h decrease (multiply by smaller number) */
@@ -228,6 +506,7 @@ void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
             scale = 1.0 / (1 - win->zoom_pct);
             break;
     }
+    scale_in = 1 - win->zoom_pct;
     /* ZOOM IN:
      * x0 = 9
      * w0 = 2
@@ -254,6 +533,8 @@ void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
         /* Scale the width and height */
         mpfr_mul_d(win->v.w_hp, win->v.w_hp, scale, MPFR_RNDN);
         mpfr_mul_d(win->v.h_hp, win->v.h_hp, scale, MPFR_RNDN);
+        win->v.w_fe = fe_mul_d(win->v.w_fe, scale);
+        win->v.h_fe = fe_mul_d(win->v.h_fe, scale);
         /* Re-calculate the x and y of the top corner */
         mpfr_div_d(tmp_hp, win->v.w_hp, 2.0, MPFR_RNDN);
         mpfr_sub(win->v.x_hp, cx_hp, tmp_hp, MPFR_RNDN);
@@ -261,6 +542,7 @@ void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
         mpfr_sub(win->v.y_hp, cy_hp, tmp_hp, MPFR_RNDN);
         /* Free the temporary mpfr_t variables */
         mpfr_clears(tmp_hp, cx_hp, cy_hp, NULL);
+        viewport_fit_precision(win);
     } else {
         /* Get the center position */
         cx = win->v.x + win->v.w/2.0;
@@ -272,6 +554,25 @@ void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir)
         win->v.x = cx - win->v.w/2.0;
         win->v.y = cy - win->v.h/2.0;
     }
+    /* Switch precision at the point doubles stop resolving pixels. Only on
+     * crossing the threshold, so a manual toggle sticks until then. */
+    if (!high_precision && dir == ZOOM_IN && win->v.w < HIGH_PRECISION_WIDTH) {
+        printf("[MASTER   ] Switching to high precision\n");
+        enable_high_precision(win);
+    } else if (high_precision && dir == ZOOM_OUT
+            && fe_to_d(win->v.w_fe) >= HIGH_PRECISION_WIDTH
+            && fe_to_d(win->v.w_fe) * scale_in < HIGH_PRECISION_WIDTH) {
+        printf("[MASTER   ] Switching to double precision\n");
+        disable_high_precision(win);
+    }
+
+    viewport_zoom_preview(win, scale);
+    /* Powers of two up to 2^16 either way */
+    if (frexp(scale, &exp) != 0.5 || exp == 1 || abs(exp - 1) > 16)
+        return false;
+    return viewport_buffer_zoom(win, exp > 1 ? 1 << (exp - 1) : 1,
+            exp < 1 ? 1 << (1 - exp) : 1,
+            !high_precision && !win->v.use_high_precision);
 }
 
 void toggle_high_precision(struct sdl_window_info *win)
@@ -290,10 +591,17 @@ void enable_high_precision(struct sdl_window_info *win)
     mpfr_set_d(win->v.y_hp, win->v.y, MPFR_RNDN);
     mpfr_set_d(win->v.w_hp, win->v.w, MPFR_RNDN);
     mpfr_set_d(win->v.h_hp, win->v.h, MPFR_RNDN);
+    win->v.w_fe = fe_from_d(win->v.w);
+    win->v.h_fe = fe_from_d(win->v.h);
 }
 
 void disable_high_precision(struct sdl_window_info *win)
 {
+    /* Leave some room for the pixel spacing, which is ~2^11 times smaller */
+    if (win->v.w_fe.e < -1000 || win->v.h_fe.e < -1000) {
+        printf("[MASTER   ] View is too deep for double precision\n");
+        return;
+    }
     win->v.use_high_precision = false;
     win->v.x = mpfr_get_d(win->v.x_hp, MPFR_RNDN);
     win->v.y = mpfr_get_d(win->v.y_hp, MPFR_RNDN);
@@ -301,3 +609,55 @@ void disable_high_precision(struct sdl_window_info *win)
     win->v.h = mpfr_get_d(win->v.h_hp, MPFR_RNDN);
     mpfr_clears(win->v.x_hp, win->v.y_hp, win->v.w_hp, win->v.h_hp, NULL);
 }
+
+bool viewport_set(struct sdl_window_info *win, const char *centre_x,
+        const char *centre_y, const char *width)
+{
+    /* Four bits a digit keeps every digit given */
+    long digits = strlen(centre_x) > strlen(centre_y) ? strlen(centre_x)
+        : strlen(centre_y);
+    if ((long) strlen(width) > digits)
+        digits = strlen(width);
+    long precision = 4 * digits + 64;
+    mpfr_t cx, cy, w;
+    if (precision < win->v.precision)
+        precision = win->v.precision;
+    mpfr_inits2(precision, cx, cy, w, NULL);
+    if (mpfr_set_str(cx, centre_x, 10, MPFR_RNDN) != 0
+            || mpfr_set_str(cy, centre_y, 10, MPFR_RNDN) != 0
+            || mpfr_set_str(w, width, 10, MPFR_RNDN) != 0
+            || mpfr_sgn(w) <= 0) {
+        mpfr_clears(cx, cy, w, NULL);
+        return false;
+    }
+    /* A deep view needs more bits than its centre has digits, or the half
+     * width taken off the centre would round away */
+    if (width_precision(fe_from_mpfr(w)) > precision) {
+        precision = width_precision(fe_from_mpfr(w));
+        mpfr_prec_round(cx, precision, MPFR_RNDN);
+        mpfr_prec_round(cy, precision, MPFR_RNDN);
+        mpfr_prec_round(w, precision, MPFR_RNDN);
+    }
+    if (win->v.use_high_precision)
+        mpfr_clears(win->v.x_hp, win->v.y_hp, win->v.w_hp, win->v.h_hp, NULL);
+    win->v.use_high_precision = true;
+    win->v.precision = precision;
+    mpfr_inits2(precision, win->v.x_hp, win->v.y_hp, win->v.w_hp, win->v.h_hp,
+            NULL);
+    mpfr_set(win->v.w_hp, w, MPFR_RNDN);
+    mpfr_mul_si(win->v.h_hp, w, win->v.view.h, MPFR_RNDN);
+    mpfr_div_si(win->v.h_hp, win->v.h_hp, win->v.view.w, MPFR_RNDN);
+    /* The corner is half the size up and left of the centre */
+    mpfr_div_2ui(win->v.x_hp, win->v.w_hp, 1, MPFR_RNDN);
+    mpfr_sub(win->v.x_hp, cx, win->v.x_hp, MPFR_RNDN);
+    mpfr_div_2ui(win->v.y_hp, win->v.h_hp, 1, MPFR_RNDN);
+    mpfr_sub(win->v.y_hp, cy, win->v.y_hp, MPFR_RNDN);
+    win->v.w_fe = fe_from_mpfr(win->v.w_hp);
+    win->v.h_fe = fe_from_mpfr(win->v.h_hp);
+    mpfr_clears(cx, cy, w, NULL);
+    if (fe_to_d(win->v.w_fe) >= HIGH_PRECISION_WIDTH)
+        disable_high_precision(win);
+    else
+        viewport_fit_precision(win);
+    return true;
+}
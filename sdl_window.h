@@ -1,18 +1,67 @@
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <mpfr.h>
 
 #include "tpool.h"
+#include "escape_kernel.h"
+#include "floatexp.h"
+#include "palette.h"
+
+/* Zooming in past this width switches the view to high precision */
+#define HIGH_PRECISION_WIDTH 5e-13
+
+/* Rows are mirrored across the real axis if the grid puts them within this
+ * fraction of a pixel of each other's conjugate */
+#define SYMMETRY_TOLERANCE (1.0 / 1024)
 
 struct viewport_mapping {
     bool use_high_precision;
     long precision;
     double x, y, w, h;
     mpfr_t x_hp, y_hp, w_hp, h_hp;  /* High-precision floats */
+    floatexp w_fe, h_fe;  /* Size in high-precision mode, can't underflow */
     SDL_Rect view;
 };
 
+/* Damage lists hold up to this many rectangles, merging any more in */
+#define DAMAGE_MAX_RECTS 64
+
+/* The parts of the surface changed since the window was last presented */
+struct damage {
+    pthread_mutex_t mtx;
+    SDL_Rect rects[DAMAGE_MAX_RECTS];
+    int n;
+    /* Pushed onto the event queue by the first change after a present, to
+     * wake the main loop for it */
+    Uint32 wake_event;
+    bool wake_sent;
+};
+
+/* Shared by the window and the frames rendering it */
+struct render_state {
+    /* Bumped for every render: frames started under an older generation are
+     * stale, and their tiles stop iterating and only mark the pixels they
+     * were to compute as not started */
+    atomic_int generation;
+    /* The tasks of every frame, finished once none are in flight */
+    struct task_group tasks;
+    atomic_bool cut_short;  /* A stale frame left pixels unfinished */
+    struct damage damage;
+    /* If not NULL, told of pixels as frames colour them for good, to be
+     * written out as they come */
+    struct png_stream *png;
+};
+
+/* The order each pass of a frame starts its tiles in */
+enum tile_order {
+    TILE_ORDER_SCAN,     /* Top left to bottom right, by halves */
+    TILE_ORDER_CENTRE,   /* Nearest the centre of the window first */
+    TILE_ORDER_HILBERT,  /* Along a Hilbert curve, so that the tiles running
+                          * at once are close together in memory */
+};
+
 struct sdl_window_info {
     SDL_Window *win;
     SDL_Surface *surf;
@@ -23,9 +72,26 @@ struct sdl_window_info {
     double mv_pct, zoom_pct;
     int max_iter;
     int _default_max_iter;
+    bool use_perturbation;  /* Deep zoom by perturbation, not per-pixel MPFR */
+    bool use_boundary_trace;  /* Mariani-Silver subdivision of the tiles */
+    bool use_progressive;  /* Render coarse passes before the full one */
+    enum tile_order tile_order;
+    /* Iteration count of each pixel of the surface, row by row, and |z|^2
+     * just after escaping. The surface is coloured from these, so they can
+     * be recoloured without iterating again. */
+    int *iters;
+    float *escaped_abs_2;
+    /* Where each pixel's orbit stands, so raising max_iter carries on */
+    struct orbit *orbits;
+    /* Kept for zooms to reuse: the copy the preview is scaled from (made
+     * on the first zoom), and the source column and row of each pixel */
+    SDL_Surface *preview;
+    int *zoom_source;
+    struct colouring colouring;
     void *(*func)(void *);
     void *(*_default_func)(void*);
     struct queue *q;
+    struct render_state *render;
 };
 
 enum MV_DIR {
@@ -42,10 +108,35 @@ enum ZOOM_DIR {
 
 struct sdl_window_info my_sdl_init(double x, double y, double w, double h,
         int w_w, int w_h, int max_iter, void *(*func)(void*));
+/* The same without a window, for rendering headless: SDL is never
+ * initialised, and frames are drawn to a surface of its own */
+struct sdl_window_info sdl_headless_init(double x, double y, double w,
+        double h, int w_w, int w_h, int max_iter, void *(*func)(void*));
+void sdl_headless_free(struct sdl_window_info *win);
 void my_sdl_reset(struct sdl_window_info *win);
 void sdl_blank_screen(struct sdl_window_info win, SDL_Rect blank_area);
-void viewport_mv(struct sdl_window_info *win, enum MV_DIR dir, struct viewport_mapping *redraw_area);
-void viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir);
+/* Note that `rect` of the surface has changed, from any thread */
+void sdl_damage(struct render_state *render, SDL_Rect rect);
+bool sdl_damaged(struct sdl_window_info win);
+/* Copy the parts of the surface changed since the last present to the
+ * window */
+void sdl_present(struct sdl_window_info win);
+void viewport_mv(struct sdl_window_info *win, enum MV_DIR dir, SDL_Rect *redraw_area);
+/* Zoom about the centre, showing the old view scaled in the meantime. If the
+ * zoom is by a power of two, pixels whose sample points the new view shares
+ * with the old are kept and the rest set to be iterated from the start, and
+ * true is returned: only those need rendering, by resuming the frame. */
+bool viewport_zoom(struct sdl_window_info *win, enum ZOOM_DIR dir);
+/* Pixel rows py and k - py of the window's grid are complex conjugates of
+ * each other. Returns k, or -1 if the grid isn't symmetric about the real
+ * axis within the window. */
+int viewport_mirror(struct sdl_window_info win);
+/* Centre the view on centre_x + centre_y*I, `width` wide, from decimal
+ * strings of any precision. In high precision if doubles couldn't resolve
+ * its pixels. Returns false, leaving the view as it was, if a string isn't
+ * a number or the width isn't positive. */
+bool viewport_set(struct sdl_window_info *win, const char *centre_x,
+        const char *centre_y, const char *width);
 void toggle_high_precision(struct sdl_window_info *win);
 void enable_high_precision(struct sdl_window_info *win);
 void disable_high_precision(struct sdl_window_info *win);
@@ -1,74 +1,472 @@
+#include <sched.h>
 #include "tpool.h"
 
+/* Tasks a deque starts with room for; it doubles when full */
+#define DEQUE_INITIAL_SIZE 1024
+/* Tasks the shared ring holds (a power of two). Threads adding to a full
+ * ring wait for the workers to make room. */
+#define QUEUE_RING_SIZE 1024
+/* Most tasks a worker takes off the ring at once */
+#define QUEUE_BATCH_MAX 64
+
+/* A task as it is passed around inside the pool */
+struct task {
+    void *func;
+    void *args;
+    struct task_group *group;
+};
+
+/* The pool and index of the worker running on this thread, if any, and the
+ * group of the task it is running */
+static _Thread_local struct queue *worker_queue;
+static _Thread_local int worker_index;
+static _Thread_local struct task_group *worker_group;
+
+static struct task_array *task_array_new(long size)
+{
+    struct task_array *a = malloc(sizeof(struct task_array)
+            + size * sizeof(struct task_slot));
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+/* Copy the tasks top..bottom-1 into an array twice the size. The old one is
+ * kept until the pool is destroyed, since thieves may still be reading it. */
+static struct task_array *deque_grow(struct task_deque *d,
+        struct task_array *a, long top, long bottom)
+{
+    struct task_array *bigger = task_array_new(2 * a->size);
+    for (long i = top; i < bottom; i++) {
+        struct task_slot *from = &a->slots[i & (a->size - 1)];
+        struct task_slot *to = &bigger->slots[i & (bigger->size - 1)];
+        atomic_store_explicit(&to->func, atomic_load_explicit(&from->func,
+                    memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&to->args, atomic_load_explicit(&from->args,
+                    memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&to->group, atomic_load_explicit(&from->group,
+                    memory_order_relaxed), memory_order_relaxed);
+    }
+    bigger->retired = a;
+    atomic_store_explicit(&d->array, bigger, memory_order_release);
+    return bigger;
+}
+
+/* Only the deque's owner may push or take */
+static void deque_push(struct task_deque *d, const struct task *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct task_array *a = atomic_load_explicit(&d->array,
+            memory_order_relaxed);
+    if (b - t > a->size - 1)
+        a = deque_grow(d, a, t, b);
+    struct task_slot *slot = &a->slots[b & (a->size - 1)];
+    atomic_store_explicit(&slot->func, task->func, memory_order_relaxed);
+    atomic_store_explicit(&slot->args, task->args, memory_order_relaxed);
+    atomic_store_explicit(&slot->group, task->group, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static bool deque_take(struct task_deque *d, struct task *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct task_array *a = atomic_load_explicit(&d->array,
+            memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+    struct task_slot *slot = &a->slots[b & (a->size - 1)];
+    task->func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+    task->args = atomic_load_explicit(&slot->args, memory_order_relaxed);
+    task->group = atomic_load_explicit(&slot->group, memory_order_relaxed);
+    if (t < b)
+        return true;
+    /* The last task: race any thief for it */
+    bool won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+/* Whether a task was stolen; *contended is set if another thread took the
+ * one this went for */
+static bool deque_steal(struct task_deque *d, struct task *task,
+        bool *contended)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return false;
+    struct task_array *a = atomic_load_explicit(&d->array,
+            memory_order_acquire);
+    struct task_slot *slot = &a->slots[t & (a->size - 1)];
+    task->func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+    task->args = atomic_load_explicit(&slot->args, memory_order_relaxed);
+    task->group = atomic_load_explicit(&slot->group, memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+        return true;
+    *contended = true;
+    return false;
+}
+
+static bool deque_empty(struct task_deque *d)
+{
+    return atomic_load(&d->bottom) <= atomic_load(&d->top);
+}
+
+/* Add a task to the ring unless it is full. Any number of threads may add
+ * and take at once. */
+static bool ring_add(struct queue *q, const struct task *task)
+{
+    long pos = atomic_load_explicit(&q->ring_head, memory_order_relaxed);
+    struct ring_cell *cell;
+    while (true) {
+        cell = &q->ring[pos & q->ring_mask];
+        long seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&q->ring_head, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->ring_head, memory_order_relaxed);
+        }
+    }
+    cell->func = task->func;
+    cell->args = task->args;
+    cell->group = task->group;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_take(struct queue *q, struct task *task)
+{
+    long pos = atomic_load_explicit(&q->ring_tail, memory_order_relaxed);
+    struct ring_cell *cell;
+    while (true) {
+        cell = &q->ring[pos & q->ring_mask];
+        long seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak_explicit(&q->ring_tail, &pos,
+                        pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (seq < pos + 1) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->ring_tail, memory_order_relaxed);
+        }
+    }
+    task->func = cell->func;
+    task->args = cell->args;
+    task->group = cell->group;
+    atomic_store_explicit(&cell->seq, pos + q->ring_mask + 1,
+            memory_order_release);
+    return true;
+}
+
+/* Tasks on the ring, counting any still being added */
+static long ring_length(struct queue *q)
+{
+    return atomic_load(&q->ring_head) - atomic_load(&q->ring_tail);
+}
+
 bool queue_empty(struct queue *q)
-{ return (q == NULL) || (q->first == NULL) || (q->last == NULL); }
+{
+    if (q == NULL)
+        return true;
+    if (q->locked)
+        return q->first == NULL;
+    if (ring_length(q) > 0)
+        return false;
+    for (int i = 0; i < q->n_workers; i++)
+        if (!deque_empty(&q->deques[i]))
+            return false;
+    return true;
+}
 
-struct queue *queue_init()
+struct queue *queue_init(int n_workers)
 {
     struct queue *q = (struct queue *)malloc(sizeof(struct queue));
     pthread_mutex_init(&q->mtx, NULL);
     pthread_cond_init(&q->cond, NULL);
+    q->ring = malloc(sizeof(struct ring_cell) * QUEUE_RING_SIZE);
+    q->ring_mask = QUEUE_RING_SIZE - 1;
+    for (long i = 0; i < QUEUE_RING_SIZE; i++)
+        atomic_init(&q->ring[i].seq, i);
+    atomic_init(&q->ring_head, 0);
+    atomic_init(&q->ring_tail, 0);
+    q->n_workers = n_workers;
+    q->deques = calloc(n_workers, sizeof(struct task_deque));
+    for (int i = 0; i < n_workers; i++) {
+        atomic_init(&q->deques[i].top, 0);
+        atomic_init(&q->deques[i].bottom, 0);
+        atomic_init(&q->deques[i].array, task_array_new(DEQUE_INITIAL_SIZE));
+    }
+    atomic_init(&q->sleeping, 0);
+    q->locked = false;
     q->first = NULL;
     q->last = NULL;
     return q;
 }
 
+/* A pool whose tasks all go through one list under a mutex, each worker
+ * taking the oldest and waiting on the condvar for more */
+struct queue *queue_init_locked(int n_workers)
+{
+    struct queue *q = queue_init(n_workers);
+    q->locked = true;
+    return q;
+}
+
 void queue_destroy(struct queue *q)
 {
-    /* Empty the queue */
-    struct queue_item *cur, *next;
-    if (!queue_empty(q)) {
-        cur = q->first;
-        while (cur != NULL) {
-            next = cur->next;
-            free(cur);
-            cur = next;
+    while (q->first != NULL) {
+        struct queue_item *next = q->first->next;
+        free(q->first);
+        q->first = next;
+    }
+    free(q->ring);
+    for (int i = 0; i < q->n_workers; i++) {
+        struct task_array *a = atomic_load(&q->deques[i].array);
+        while (a != NULL) {
+            struct task_array *retired = a->retired;
+            free(a);
+            a = retired;
         }
     }
+    free(q->deques);
     pthread_mutex_destroy(&q->mtx);
     pthread_cond_destroy(&q->cond);
     free(q);
 }
 
-void queue_add(struct queue * q, void *(*func)(void *), void *args)
+/* Wake a sleeping worker, if there is one, for a task just added */
+static void queue_wake(struct queue *q)
 {
-    struct queue_item *new;
-    new = (struct queue_item*)malloc(sizeof(struct queue_item));
-    new->prev = NULL;
-    new->next = NULL;
-    new->func = func;
-    new->args = args;
+    /* Pairs with the fence in queue_sleep(): either this sees the worker
+     * asleep or the worker sees the task */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&q->mtx);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+/* Count a task in its group, starting the group's clock if it had none */
+static void task_group_add(struct task_group *g)
+{
+    if (atomic_fetch_add(&g->pending, 1) != 0)
+        return;
+    pthread_mutex_lock(&g->mtx);
+    clock_gettime(CLOCK_MONOTONIC, &g->start);
+    atomic_store(&g->busy_nanos, 0);
+    pthread_mutex_unlock(&g->mtx);
+}
+
+/* Count a task of the group as returned, finishing the group if it was the
+ * last and no task has been added to it since */
+static void task_group_done(struct task_group *g)
+{
+    if (atomic_fetch_sub(&g->pending, 1) != 1)
+        return;
+    pthread_mutex_lock(&g->mtx);
+    if (atomic_load(&g->pending) == 0) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        g->elapsed_nanos = (end.tv_sec - g->start.tv_sec) * 1000000000L
+            + end.tv_nsec - g->start.tv_nsec;
+        if (g->on_done != NULL)
+            g->on_done(g, g->data);
+        pthread_cond_broadcast(&g->cond);
+    }
+    pthread_mutex_unlock(&g->mtx);
+}
 
+/* Append a task to the locked list and wake a worker for it */
+static void queue_add_locked(struct queue *q, const struct task *task)
+{
+    struct queue_item *item = malloc(sizeof(struct queue_item));
+    item->next = NULL;
+    item->func = task->func;
+    item->args = task->args;
+    item->group = task->group;
     pthread_mutex_lock(&q->mtx);
+    if (q->last != NULL && q->first != NULL)
+        q->last->next = item;
+    else
+        q->first = item;
+    q->last = item;
+    pthread_mutex_unlock(&q->mtx);
+    pthread_cond_signal(&q->cond);
+}
 
-    if (q && q->first && q->last) {
-        q->last->next = new;
-        new->prev = q->last;
-        q->last = new;
+/* Add a task to group g of the pool's tasks (none if g is NULL) */
+void queue_add_group(struct queue *q, struct task_group *g,
+        void *(*func)(void *), void *args)
+{
+    struct task task = {(void *) func, args, g};
+    if (g != NULL)
+        task_group_add(g);
+    if (q->locked) {
+        queue_add_locked(q, &task);
+    } else if (worker_queue == q) {
+        deque_push(&q->deques[worker_index], &task);
     } else {
-        q->first = new;
-        q->last = new;
+        while (!ring_add(q, &task))
+            sched_yield();
     }
+    queue_wake(q);
+}
 
-    pthread_mutex_unlock(&q->mtx);
+/* Add a task to the group of the task adding it, if any */
+void queue_add(struct queue * q, void *(*func)(void *), void *args)
+{
+    queue_add_group(q, worker_group, func, args);
+}
 
-    /* Signal waiting threads */
-    pthread_cond_signal(&q->cond);
+/* Take the oldest task on the ring, and this worker's share of those after
+ * it onto its own deque, where other workers can steal them */
+static bool queue_take_shared(struct queue *q, int worker, struct task *task)
+{
+    struct task batch[QUEUE_BATCH_MAX];
+    long n = ring_length(q) / q->n_workers;
+    if (n < 1)
+        n = 1;
+    if (n > QUEUE_BATCH_MAX)
+        n = QUEUE_BATCH_MAX;
+    int taken = 0;
+    while (taken < n && ring_take(q, &batch[taken]))
+        taken++;
+    if (taken == 0)
+        return false;
+    /* The rest go on in reverse, so this worker takes them in order */
+    for (int i = taken - 1; i > 0; i--)
+        deque_push(&q->deques[worker], &batch[i]);
+    *task = batch[0];
+    if (taken > 1)
+        queue_wake(q);
+    return true;
+}
+
+/* Steal from the other workers in turn, starting after this one */
+static bool queue_steal(struct queue *q, int worker, struct task *task)
+{
+    bool contended;
+    do {
+        contended = false;
+        for (int i = 1; i < q->n_workers; i++) {
+            int victim = (worker + i) % q->n_workers;
+            if (deque_steal(&q->deques[victim], task, &contended))
+                return true;
+        }
+    } while (contended);
+    return false;
 }
 
-void queue_get(struct queue *q, void (**func)(void *), void **args)
+/* Take the oldest task on the locked list, waiting for one if need be */
+static void queue_take_locked(struct queue *q, struct task *task)
 {
     pthread_mutex_lock(&q->mtx);
+    while (q->first == NULL)
+        pthread_cond_wait(&q->cond, &q->mtx);
+    struct queue_item *item = q->first;
+    q->first = item->next;
+    pthread_mutex_unlock(&q->mtx);
+    task->func = item->func;
+    task->args = item->args;
+    task->group = item->group;
+    free(item);
+}
 
-    while (queue_empty(q))
+/* Wait until a task may have been added */
+static void queue_sleep(struct queue *q)
+{
+    pthread_mutex_lock(&q->mtx);
+    atomic_fetch_add(&q->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue_empty(q))
         pthread_cond_wait(&q->cond, &q->mtx);
+    atomic_fetch_sub(&q->sleeping, 1);
+    pthread_mutex_unlock(&q->mtx);
+}
 
-    /* Get the item from the first queue entry and free that entry */
-    *func = (void (*)(void*))q->first->func;
-    *args = q->first->args;
-    struct queue_item *next = q->first->next;
-    free(q->first);
-    q->first = next;
+/* Run a task as worker `worker` of the pool, waiting for one if there are
+ * none: its own newest task, else the oldest on the shared ring, else one
+ * stolen from another worker. The calling thread becomes that worker, so the
+ * tasks it adds from then on go on its own deque. A worker only looks
+ * elsewhere once its own deque is empty, so tasks ending the threads, added
+ * after the rest, still run last; any left on the deque of a worker that has
+ * ended are stolen by the others. */
+void queue_run_next(struct queue *q, int worker)
+{
+    struct task task;
+    worker_queue = q;
+    worker_index = worker;
+    if (q->locked) {
+        queue_take_locked(q, &task);
+    } else {
+        while (!deque_take(&q->deques[worker], &task)
+                && !queue_take_shared(q, worker, &task)
+                && !queue_steal(q, worker, &task))
+            queue_sleep(q);
+    }
+    void *(*func)(void *) = (void *(*)(void *)) task.func;
+    if (task.group == NULL) {
+        func(task.args);
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    worker_group = task.group;
+    func(task.args);
+    worker_group = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    atomic_fetch_add(&task.group->busy_nanos,
+            (end.tv_sec - start.tv_sec) * 1000000000L
+            + end.tv_nsec - start.tv_nsec);
+    task_group_done(task.group);
+}
 
-    pthread_mutex_unlock(&q->mtx);
+void task_group_init(struct task_group *g,
+        void (*on_done)(struct task_group *, void *), void *data)
+{
+    atomic_init(&g->pending, 0);
+    g->on_done = on_done;
+    g->data = data;
+    g->elapsed_nanos = 0;
+    atomic_init(&g->busy_nanos, 0);
+    pthread_mutex_init(&g->mtx, NULL);
+    pthread_cond_init(&g->cond, NULL);
+}
+
+void task_group_destroy(struct task_group *g)
+{
+    pthread_mutex_destroy(&g->mtx);
+    pthread_cond_destroy(&g->cond);
+}
+
+/* Whether all the tasks added to the group so far have returned */
+bool task_group_finished(struct task_group *g)
+{
+    return atomic_load(&g->pending) == 0;
+}
+
+/* Wait for all the group's tasks, including any they add, to return. Not to
+ * be called from one of them. */
+void task_group_wait(struct task_group *g)
+{
+    pthread_mutex_lock(&g->mtx);
+    while (atomic_load(&g->pending) > 0)
+        pthread_cond_wait(&g->cond, &g->mtx);
+    pthread_mutex_unlock(&g->mtx);
 }
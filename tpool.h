@@ -2,31 +2,109 @@
 #define __TPOOL_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 #include "png_maker.h"
 
-struct queue {
-    pthread_cond_t cond;
+/* A set of tasks to wait for or poll as one. A task added to a group, or
+ * added by a task of the group while it runs, belongs to the group until
+ * it returns. The group is finished whenever none of its tasks are left,
+ * and can be added to again after that. */
+struct task_group {
+    atomic_int pending;  /* Tasks added and not yet returned */
+    /* Called by the worker that finishes the group, if not NULL, under mtx */
+    void (*on_done)(struct task_group *g, void *data);
+    void *data;
+    /* Of the group's last run, from its first task being added to its last
+     * returning: when it started, how long it took, and the time its tasks
+     * spent running, summed over the workers */
+    struct timespec start;
+    long elapsed_nanos;
+    atomic_long busy_nanos;
     pthread_mutex_t mtx;
-    struct queue_item *first;
-    struct queue_item *last;
+    pthread_cond_t cond;
 };
 
-struct queue_item {
-    struct queue_item *prev;
-    void *(*func)(void*);
+/* One task: func(args), in group (or none if NULL) */
+struct task_slot {
+    _Atomic(void *) func;
+    _Atomic(void *) args;
+    _Atomic(struct task_group *) group;
+};
+
+struct task_array {
+    long size;  /* A power of two */
+    struct task_array *retired;  /* Smaller arrays thieves may still read */
+    struct task_slot slots[];
+};
+
+/* A worker's own tasks (a Chase-Lev deque): it pushes and takes them at the
+ * bottom, most recent first, and idle workers steal the oldest at the top */
+struct task_deque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(struct task_array *) array;
+    /* Keep each deque's ends off the cache lines of the next */
+    char pad[64];
+};
+
+/* A slot of the shared ring: free for the task at position pos while seq
+ * is pos, holding it once seq is pos + 1 */
+struct ring_cell {
+    atomic_long seq;
+    void *func;
     void *args;
+    struct task_group *group;
+};
+
+/* A task on the locked list of a pool made by queue_init_locked() */
+struct queue_item {
     struct queue_item *next;
+    void *func;
+    void *args;
+    struct task_group *group;
+};
+
+/* A work-stealing pool of tasks. Tasks added by a worker go on its own
+ * deque; those added by any other thread go on a fixed-size ring shared by
+ * all, from which workers take them in batches. */
+struct queue {
+    pthread_cond_t cond;
+    pthread_mutex_t mtx;
+    struct ring_cell *ring;
+    long ring_mask;
+    /* Positions of the next task to add and to take from the ring */
+    atomic_long ring_head;
+    char pad[64];
+    atomic_long ring_tail;
+    int n_workers;
+    struct task_deque *deques;
+    atomic_int sleeping;  /* Workers waiting on cond, under mtx */
+    /* If set, every task goes through one list under mtx instead, as before
+     * the pool stole work, so `mandelbrot --bench-pool` can compare them */
+    bool locked;
+    struct queue_item *first;
+    struct queue_item *last;
 };
 
-struct queue *queue_init(void);
+struct queue *queue_init(int n_workers);
+struct queue *queue_init_locked(int n_workers);
 void queue_destroy(struct queue *q);
 void queue_add(struct queue *q, void *(*func)(void *), void *args);
-void queue_get(struct queue *q, void (**func)(void *), void **args);
+void queue_add_group(struct queue *q, struct task_group *g,
+        void *(*func)(void *), void *args);
+void queue_run_next(struct queue *q, int worker);
 bool queue_empty(struct queue *q);
 
+void task_group_init(struct task_group *g,
+        void (*on_done)(struct task_group *, void *), void *data);
+void task_group_destroy(struct task_group *g);
+bool task_group_finished(struct task_group *g);
+void task_group_wait(struct task_group *g);
+
 
 struct spin_thread_args {
     int id;